@@ -0,0 +1,108 @@
+#ifndef AUDIO_GENERATOR_HPP
+#define AUDIO_GENERATOR_HPP
+
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <optional>
+#include <utility>
+#include <vector>
+
+struct AudioChunk
+{
+  std::vector<uint8_t> data;
+  int num_samples; // Needed for timestamping
+};
+
+/**
+ * Coroutine based audio provider. The coroutine co_yields filled chunks and may co_await anything in between
+ * (e.g. a read completion or a decoder thread), it's resumed by RtspPusher when the pipeline needs more data
+ * and it is not resumed while the pipeline has enough of it.
+ * It's resumed on the main loop thread shared by all the pushers, so it should co_await instead of blocking.
+ *
+ * AudioGenerator produce(Decoder &decoder)
+ * {
+ *   while (!decoder.finished())
+ *   {
+ *     co_yield co_await decoder.next_chunk();
+ *   }
+ * }
+ *
+ * The stream ends when the coroutine returns.
+ */
+class AudioGenerator
+{
+public:
+  struct promise_type
+  {
+    std::optional<AudioChunk> chunk;
+    std::exception_ptr exception;
+    std::function<bool()> on_suspend;
+
+    // Notifies only after the coroutine is suspended, so it can be resumed from another thread right away
+    struct NotifyingAwaiter
+    {
+      bool await_ready() const noexcept;
+      void await_suspend(std::coroutine_handle<promise_type> handle) const noexcept;
+      void await_resume() const noexcept;
+    };
+
+    AudioGenerator get_return_object();
+
+    std::suspend_always initial_suspend() noexcept;
+
+    NotifyingAwaiter final_suspend() noexcept;
+
+    NotifyingAwaiter yield_value(AudioChunk chunk);
+
+    void return_void();
+
+    void unhandled_exception();
+  };
+
+  AudioGenerator(AudioGenerator &&other);
+
+  AudioGenerator &operator=(AudioGenerator &&other);
+
+  AudioGenerator(const AudioGenerator &) = delete;
+
+  AudioGenerator &operator=(const AudioGenerator &) = delete;
+
+  /**
+   * Runs the coroutine until its next suspension point.
+   */
+  void resume();
+
+  bool done() const;
+
+  /**
+   * @return the last yielded chunk, std::nullopt if it was already taken.
+   */
+  std::optional<AudioChunk> take_chunk();
+
+  /**
+   * Rethrows the exception that escaped the coroutine, if any.
+   */
+  void rethrow_if_failed() const;
+
+  /**
+   * @param on_suspend called every time the coroutine yields a chunk or finishes, from the thread it was running on.
+   * If it returns false the coroutine is destroyed right away (see release()).
+   */
+  void set_on_suspend(const std::function<bool()> &on_suspend);
+
+  /**
+   * Gives up the ownership of a running coroutine without destroying it,
+   * it has to be destroyed by on_suspend returning false.
+   */
+  void release();
+
+  ~AudioGenerator();
+
+private:
+  explicit AudioGenerator(std::coroutine_handle<promise_type> handle);
+
+  std::coroutine_handle<promise_type> handle;
+};
+#endif // AUDIO_GENERATOR_HPP
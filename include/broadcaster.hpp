@@ -5,7 +5,14 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <set>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <chrono>
+#include <memory>
+#include <functional>
 #include <stdexcept>
 #include <optional>
 #include "../external/httplib.h"
@@ -34,6 +41,15 @@ struct Client
   nlohmann::json to_json() const;
 };
 
+struct Rendition
+{
+  std::string path;
+  int bitrate; // kbps
+  Urls urls;
+
+  nlohmann::json to_json() const;
+};
+
 struct Room
 {
   std::string path;
@@ -44,6 +60,17 @@ struct Room
   std::string data_url;
   bool has_audio_data_provider;
   bool has_text_data_provider;
+  std::vector<Rendition> renditions;
+
+  nlohmann::json to_json() const;
+};
+
+struct KickReport
+{
+  size_t requested = 0;
+  size_t kicked = 0; // Including clients that had already disconnected
+  size_t failed = 0;
+  std::chrono::milliseconds latency{0}; // From the start of enforcement until the last kick was answered
 
   nlohmann::json to_json() const;
 };
@@ -55,6 +82,9 @@ public:
 
   /**
    * After calling this clients can ask for the list of rooms (GET /v1/rooms).
+   * The list is sorted by path and accepts optional query parameters:
+   * prefix (only paths starting with it), fields (comma separated list of room fields to return),
+   * limit (max number of rooms) and cursor (nextCursor returned by the previous page).
    * If server is already running it won't do anything.
    * @param ip ip of the http server.
    * @param port port of the http server.
@@ -68,7 +98,8 @@ public:
   void stop_http_server();
 
   /**
-   * If somethig is already published at the given path it won't do anything.
+   * If something is already published at the given path it is replaced (see unpublish_audio()),
+   * together with its bitrate ladder sub-paths.
    * If the room (path) does not exist it will be created using create_new_room() with default parameters.
    * So it may throw the same as the create_new_room() does.
    * @param path where to publish the stream (Note: do not add leading '/' character).
@@ -76,12 +107,22 @@ public:
    * @param audio_format format of the audio data written by data_provider.
    * @param chunk_size size of the buffer (in bytes) provided to data_provider.
    * @param sample_rate sample rate of the audio data written by data_provider.
-   * @return true if the stream was published, false if it already exists.
+   * @param bitrates optional bitrate ladder (in kbps between 4 and 650 without duplicates, e.g. {24, 64, 128}). Every bitrate is encoded from the same
+   * converted stream and published to its own sub-path ("<path>/<bitrate>k") next to the default stream at path.
+   * The readers of the sub-paths count towards max_readers and currentClientsNumber of the room.
+   */
+  void publish_audio(const std::string &path, const std::function<int(uint8_t *buffer, int chunk_size, int sample_rate)> &data_provider, GstAudioFormat audio_format, int chunk_size = 1024, int sample_rate = 44100, const std::vector<int> &bitrates = {});
+
+  /**
+   * Same as above, but the audio is yielded by a coroutine (see AudioGenerator).
+   * The coroutine is resumed only when the stream needs more data, so it can wait for its audio without blocking.
+   * @param generator coroutine that yields chunks of audio in audio_format.
    */
-  void publish_audio(const std::string &path, const std::function<int(uint8_t *buffer, int chunk_size, int sample_rate)> &data_provider, GstAudioFormat audio_format, int chunk_size = 1024, int sample_rate = 44100);
+  void publish_audio(const std::string &path, AudioGenerator generator, GstAudioFormat audio_format, int sample_rate = 44100, const std::vector<int> &bitrates = {});
 
   /**
    * Do nothing if the stream is not published or the room (path) does not exist.
+   * Sub-paths of the bitrate ladder are removed from the media server.
    * @param path where to unpublish stream from (Note: do not add leading '/' character).
    */
   void unpublish_audio(const std::string &path);
@@ -91,11 +132,56 @@ public:
   void unpublish_text_data(const std::string &path);
 
   /**
+   * The client is looked up in the client index (see start_client_monitor()), which is refreshed once if the id is unknown.
+   * Nothing happens if the client is not connected.
    * It may throw if the media server responds with an error or the response is invalid.
    * @param client_id id of the client to kick.
    */
   void kick_client(const std::string &client_id);
 
+  /**
+   * Kicks all clients of the room (including the ones of its bitrate ladder) concurrently.
+   * It may throw if the client index could not be refreshed.
+   * @param path room to empty (Note: do not add leading '/' character).
+   * @return number of kicked clients and how long it took.
+   */
+  KickReport kick_room_clients(const std::string &path);
+
+  /**
+   * Kicks concurrently all clients for which predicate returns true.
+   * It may throw if the client index could not be refreshed.
+   * @param predicate gets path of the room and the client.
+   * @return number of kicked clients and how long it took.
+   */
+  KickReport kick_clients(const std::function<bool(const std::string &path, const Client &client)> &predicate);
+
+  /**
+   * Starts refreshing the client index from a single list of the media server paths in the background.
+   * On every refresh rooms with more readers than max_readers (together with their bitrate ladder) and clients rejected by the client policy are kicked.
+   * The readers that connected last are the ones kicked from a room over its limit.
+   * If the monitor is already running it won't do anything.
+   * @param refresh_interval time between refreshes.
+   */
+  void start_client_monitor(std::chrono::milliseconds refresh_interval = std::chrono::seconds(1));
+
+  /**
+   * Stop the client monitor and wait for it to finish.
+   * If the monitor is not running it won't do anything.
+   */
+  void stop_client_monitor();
+
+  /**
+   * Clients for which policy returns false are kicked by the client monitor.
+   * It's called from the monitor thread. Empty function disables the policy.
+   * @return this
+   */
+  Broadcaster *set_client_policy(const std::function<bool(const std::string &path, const Client &client)> &policy);
+
+  /**
+   * @return result of the last enforcement of the client monitor that had clients to kick.
+   */
+  KickReport get_last_enforcement_report();
+
   /**
    * @return list of rooms.
    */
@@ -118,7 +204,8 @@ public:
    * Nothing will happen if the room already exists.
    * It may throw if the media server responds with an error or the response is invalid.
    * @param path  path where the room will be available (Note: do not add leading '/' character).
-   * @param max_readers 0 means unlimited.
+   * @param max_readers 0 means unlimited. The media server applies it to every path of the room on its own,
+   * the limit of the room as a whole (the default stream with its bitrate ladder) is enforced by the client monitor (see start_client_monitor()).
    */
   void create_new_room(const std::string &path, const std::string &title = "", const std::string &description = "", int max_readers = 0);
 
@@ -129,6 +216,47 @@ public:
    */
   void delete_room(const std::string &path);
 
+  /**
+   * Enables the room snapshot. Every created/deleted room is appended to the file at snapshot_path,
+   * so the rooms can be brought back with restore_rooms() after a restart.
+   * The file is rewritten with only the current rooms when paths are deleted and it has grown much bigger than them.
+   * Empty path disables it.
+   * @return this
+   */
+  Broadcaster *set_snapshot_path(const std::string &snapshot_path);
+
+  std::string get_snapshot_path() const;
+
+  /**
+   * Recreates the rooms recorded in the snapshot (see set_snapshot_path()).
+   * The snapshot is diffed against a single listing of the media server paths, so only the missing paths are added
+   * and only the stale ones created by us earlier (e.g. deleted rooms, bitrate ladder sub-paths) are deleted.
+   * Rooms that exist already are kept as they are, including the bitrate ladder they are publishing.
+   * Existing paths with a different maxReaders are updated.
+   * Afterwards the snapshot file is compacted.
+   * It does nothing if the snapshot file does not exist yet.
+   * It may throw if the snapshot path is not set or the media server responds with an error or the response is invalid.
+   */
+  void restore_rooms();
+
+  /**
+   * Archives every published audio stream to <options.directory>/<path> without re-encoding it.
+   * It applies to the streams published after calling it. std::nullopt disables archiving.
+   * It throws if max_queued_buffers is 0.
+   * @return this
+   */
+  Broadcaster *set_archive_options(const std::optional<RtspPusher::ArchiveOptions> &options);
+
+  /**
+   * Searches all archived publishings of the room (also the ones of previous runs), see RtspPusher::load_archive_segments().
+   * The indexes are read only on the first lookup of the room, the publishings of this broadcaster keep it up to date afterwards.
+   * The room does not need to exist anymore, but archiving has to be configured (set_archive_options()).
+   * @param path room of the archive (Note: do not add leading '/' character).
+   * @param time wall clock time to look up.
+   * @return archive segment that contains the given time.
+   */
+  std::optional<RtspPusher::ArchiveSegment> find_archived_segment(const std::string &path, std::chrono::system_clock::time_point time);
+
   /**
    * Whether to delete rooms on the media server when destructor is called.
    * @return this
@@ -154,16 +282,149 @@ private:
     int max_readers;
     Urls urls;
     std::string data_url;
+    std::vector<Rendition> renditions;
     std::optional<RtspPusher> pusher;
     std::optional<std::function<void(json &data)>> text_data_provider;
   };
 
+  struct ClientLocation
+  {
+    std::string path;
+    std::string type;
+  };
+
+  // Archived segments per archive directory, guarded by mutex.
+  // Shared with the callbacks of the pushers, so it can outlive the broadcaster.
+  struct ArchiveIndex
+  {
+    std::mutex mutex;
+    std::map<std::string, std::vector<RtspPusher::ArchiveSegment>> segments; // Sorted by start_time
+  };
+
+  std::string media_server_api_url;
   httplib::Client api_client;
   httplib::Server server;
   std::string server_ip;
   int server_port;
   std::thread server_thread;
   bool delete_rooms_in_destructor = false;
+  std::string snapshot_path;
+  size_t snapshot_entries = 0; // Lines in the snapshot file, written by this process or at the last compaction
+  std::optional<RtspPusher::ArchiveOptions> archive_options;
+  // Loaded from the indexes on the first lookup of a room, then updated by its pushers
+  std::shared_ptr<ArchiveIndex> archive_index = std::make_shared<ArchiveIndex>();
   std::map<std::string, RoomData> rooms;
+
+  // Serialized "key":value fields of a room for GET /v1/rooms,
+  // currentClientsNumber is a placeholder filled in on every request
+  using RoomJsonFields = std::vector<std::pair<std::string, std::string>>;
+
+  // Read by the http server threads, guarded by rooms_json_mutex
+  std::mutex rooms_json_mutex;
+  std::map<std::string, std::shared_ptr<const RoomJsonFields>> rooms_json;
+
+  // Shared with the client monitor thread, guarded by client_index_mutex
+  std::mutex client_index_mutex;
+  std::unordered_map<std::string, ClientLocation> client_index;
+  std::map<std::string, int> reader_limits; // Room -> max_readers (0 means unlimited)
+  std::map<std::string, std::string> reader_rooms; // Media server path (room or rendition) -> room it counts towards
+  std::function<bool(const std::string &path, const Client &client)> client_policy;
+  KickReport last_enforcement_report;
+
+  std::thread client_monitor_thread;
+  std::mutex client_monitor_mutex;
+  std::condition_variable client_monitor_cv;
+  bool client_monitor_running = false;
+
+  /**
+   * Creates the room if needed, replaces its previous stream and creates the bitrate ladder sub-paths.
+   * @return outputs for the pusher of the room.
+   */
+  std::vector<RtspPusher::Output> prepare_audio_outputs(const std::string &path, const std::vector<int> &bitrates);
+
+  std::optional<RtspPusher::ArchiveOptions> get_room_archive_options(const std::string &path) const;
+
+  /**
+   * Adds a segment opened or closed by a pusher to the archive index, if the directory is loaded already.
+   */
+  static void update_archive_index(ArchiveIndex &index, const std::string &directory, const RtspPusher::ArchiveSegment &segment);
+
+  void handle_get_rooms(const httplib::Request &req, httplib::Response &res);
+
+  /**
+   * Serializes the room for GET /v1/rooms into a new snapshot, it has to be called whenever the room changes.
+   */
+  void update_room_json_cache(const std::string &path);
+
+  json get_media_server_config();
+
+  Urls make_urls(const json &media_server_config, const std::string &path) const;
+
+  void add_media_server_path(const std::string &path, int max_readers);
+
+  void update_media_server_path(const std::string &path, int max_readers);
+
+  void delete_media_server_path(const std::string &path);
+
+  /**
+   * Fetches all items of a paginated media server list endpoint (e.g. /v3/config/paths/list).
+   */
+  json get_media_server_items(const std::string &endpoint);
+
+  static json get_media_server_items(httplib::Client &client, const std::string &endpoint);
+
+  /**
+   * Replaces the client index with a single listing of the media server paths.
+   * @return readers of every path in the order reported by the media server.
+   */
+  std::map<std::string, std::vector<Client>> refresh_client_index(httplib::Client &client);
+
+  /**
+   * Kicks the clients concurrently, each worker uses its own connection to the media server.
+   */
+  KickReport kick_many(const std::vector<Client> &clients, std::chrono::steady_clock::time_point start_time);
+
+  /**
+   * @return false if the client is not connected (anymore).
+   */
+  static bool kick(httplib::Client &client, const Client &target);
+
+  /**
+   * std::nullopt removes the room together with its renditions.
+   */
+  void set_reader_limit(const std::string &path, std::optional<int> max_readers);
+
+  /**
+   * @param room room whose readers include the ones of the rendition, std::nullopt removes the rendition.
+   */
+  void set_rendition_room(const std::string &rendition_path, const std::optional<std::string> &room);
+
+  /**
+   * @return media server path -> room, for all the rooms and their renditions.
+   */
+  std::map<std::string, std::string> get_reader_rooms();
+
+  void enforce_client_policies(httplib::Client &client);
+
+  /**
+   * Lists the sessions/connections of the given client types (one request per type).
+   * @return client id -> when it connected, the types whose list failed are missing.
+   */
+  std::unordered_map<std::string, std::chrono::system_clock::time_point> get_connection_times(httplib::Client &client, const std::set<std::string> &types);
+
+  /**
+   * @param time RFC 3339 time as reported by the media server.
+   */
+  static std::optional<std::chrono::system_clock::time_point> parse_media_server_time(const std::string &time);
+
+  void append_to_snapshot(const json &entry);
+
+  void write_snapshot();
+
+  /**
+   * Compacts the snapshot once it has grown to many more entries than there are paths.
+   * It may only be called when the rooms match the journal (no operation half done).
+   */
+  void compact_snapshot_if_needed();
 };
 #endif // BROADCASTER_HPP
\ No newline at end of file
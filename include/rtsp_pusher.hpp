@@ -5,14 +5,79 @@
 #include <iostream>
 #include <future>
 #include <functional>
+#include <vector>
+#include <optional>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <chrono>
 #include <gst/gst.h>
 #include <gst/audio/audio.h>
+#include "audio_generator.hpp"
 
 class RtspPusher
 {
 public:
+  /**
+   * One encoded rendition of the stream.
+   * rtsp_url where the rendition is pushed to.
+   * bitrate opus bitrate in bits per second, 0 keeps the encoder default.
+   */
+  struct Output
+  {
+    std::string rtsp_url;
+    int bitrate = 0;
+  };
+
+  /**
+   * Times are wall clock, so the segments of different publishings (and runs) can be searched together.
+   * end_time is std::nullopt while the segment is being written.
+   */
+  struct ArchiveSegment
+  {
+    std::string location;
+    std::chrono::system_clock::time_point start_time;
+    std::optional<std::chrono::system_clock::time_point> end_time;
+  };
+
+  /**
+   * Archive of the encoded stream (no re-encoding), split into segment files.
+   * directory where the segments and their index (<prefix>.idx, see load_archive_segments()) are written, it's created if needed.
+   * container "ogg" or "mkv".
+   * max_segment_bytes size after which a new segment is started, 0 means no limit.
+   * max_segment_duration duration after which a new segment is started, 0 means no limit.
+   * max_queued_buffers buffers waiting for the disk (at least 1), the oldest ones are dropped when it's full so the live stream is never held back.
+   * on_segment called from the main loop thread after a segment was opened or closed and written to the index.
+   */
+  struct ArchiveOptions
+  {
+    std::string directory;
+    std::string container = "ogg";
+    guint64 max_segment_bytes = 0;
+    GstClockTime max_segment_duration = 10 * 60 * GST_SECOND;
+    guint max_queued_buffers = 500;
+    std::function<void(const ArchiveSegment &segment)> on_segment;
+  };
+
   RtspPusher(const std::string &rtsp_url, const std::function<int(uint8_t *buffer, int chunk_size, int sample_rate)> &data_provider, GstAudioFormat audio_format, int chunk_size = 1024, int sample_rate = 44100);
 
+  /**
+   * Decodes and converts the audio once and encodes it separately for each of the outputs.
+   * @param outputs renditions to publish, it must not be empty.
+   * @param archive if set, the first output is also archived to disk.
+   */
+  RtspPusher(const std::vector<Output> &outputs, const std::function<int(uint8_t *buffer, int chunk_size, int sample_rate)> &data_provider, GstAudioFormat audio_format, int chunk_size = 1024, int sample_rate = 44100, const std::optional<ArchiveOptions> &archive = std::nullopt);
+
+  /**
+   * Same as above, but the audio comes from a coroutine that is resumed only while the pipeline needs data,
+   * so it never blocks the streaming thread while waiting for its audio.
+   * @param generator see AudioGenerator.
+   * @param sample_rate sample rate of the yielded audio data.
+   */
+  RtspPusher(const std::vector<Output> &outputs, AudioGenerator &&generator, GstAudioFormat audio_format, int sample_rate = 44100, const std::optional<ArchiveOptions> &archive = std::nullopt);
+
   RtspPusher(RtspPusher &&other);
 
   RtspPusher &operator=(RtspPusher &&other);
@@ -21,35 +86,137 @@ public:
 
   void stop();
 
+  /**
+   * @return segments archived by this pusher sorted by time, empty if archiving is disabled.
+   */
+  std::vector<ArchiveSegment> get_archive_segments() const;
+
+  /**
+   * Reads the indexes of all publishings archived in the directory, including the ones of the current process.
+   * A segment that was never closed (e.g. after a crash) ends where the next one starts.
+   * @param directory archive directory (ArchiveOptions::directory).
+   * @return segments sorted by time.
+   */
+  static std::vector<ArchiveSegment> load_archive_segments(const std::string &directory);
+
+  /**
+   * Binary search in segments sorted by start_time, a segment that is still being written contains the times up to now.
+   * @return segment that contains the given time.
+   */
+  static std::optional<ArchiveSegment> find_archive_segment(const std::vector<ArchiveSegment> &segments, std::chrono::system_clock::time_point time);
+
   ~RtspPusher();
 
 private:
+  struct EncoderBranch
+  {
+    GstElement *queue, *audio_encode, *audio_parse, *audio_sink;
+    GstPad *encode_tee_pad, *queue_pad, *parse_src_pad, *rtsp_sink_pad;
+  };
+
+  struct ArchiveBranch
+  {
+    GstElement *tee, *queue, *muxer, *sink;
+    GstPad *tee_sink_pad, *live_tee_pad, *archive_tee_pad, *queue_pad, *queue_src_pad, *sink_pad;
+    std::string index_path;
+    std::chrono::system_clock::time_point start_time; // Wall clock at running time 0
+    std::vector<ArchiveSegment> segments; // Sorted by start_time, guarded by mutex
+    std::mutex mutex;
+    std::condition_variable finished_cv;
+    bool finished = false; // The pipeline reached EOS or failed, guarded by mutex
+    std::function<void(const ArchiveSegment &segment)> on_segment;
+  };
+
+  struct GstreamerData;
+
+  // Shared with the callbacks of the generator, so they can outlive the pusher
+  struct GeneratorSlot
+  {
+    std::mutex mutex;
+    std::optional<AudioGenerator> generator;
+    GstreamerData *data; // nullptr once the pusher is destroyed
+    bool running = false; // Resumed and not suspended at co_yield yet
+    bool has_chunk = false; // Suspended at co_yield, the chunk is waiting for generator_suspended
+  };
+
+  // Single GLib dispatch thread shared by all the pushers, it runs while any pusher is started
+  struct SharedMainLoop
+  {
+    std::mutex mutex;
+    size_t users = 0;
+    GMainLoop *loop = nullptr;
+    std::thread thread;
+  };
+
   struct GstreamerData
   {
     GstElement *pipeline, *app_source, *tee, *audio_queue, *audio_convert1,
-        *audio_resample, *audio_encode, *audio_parse, *audio_sink;
+        *audio_resample, *encode_tee;
+    std::vector<EncoderBranch> encoder_branches; // One per output, fed by encode_tee
+    std::unique_ptr<ArchiveBranch> archive; // Tapped after the parser of the first output
     guint64 num_samples; // Number of samples generated so far (for timestamp generation)
     guint sourceid;
-    GMainLoop *main_loop;
-    GstPad *tee_audio_pad, *queue_audio_pad, *parse_src_pad, *rtsp_sink_pad;
+    bool main_loop_acquired;
+    GstPad *tee_audio_pad, *queue_audio_pad;
     GstAudioInfo info;
     GstCaps *audio_caps;
     GstBus *bus;
-    std::string rtsp_url;
+    std::vector<Output> outputs;
     std::function<int(uint8_t *, int, int)> data_provider;
+    std::shared_ptr<GeneratorSlot> generator_slot; // Used instead of data_provider if set
+    std::atomic<bool> feeding;
     int chunk_size;
     int sample_rate;
   };
 
-  std::future<void> g_main_loop_future;
   std::unique_ptr<GstreamerData> data_ptr;
 
+  static SharedMainLoop &shared_main_loop();
+
+  static void acquire_main_loop();
+
+  static void release_main_loop();
+
+  /**
+   * Runs the function on the shared main loop thread and waits for it,
+   * afterwards none of the callbacks is running.
+   */
+  static void run_on_main_loop(const std::function<void()> &function);
+
+  void build_pipeline(const std::vector<Output> &outputs, GstAudioFormat audio_format, const std::optional<ArchiveOptions> &archive);
+
   static gboolean push_data(GstreamerData *data);
 
+  static GstFlowReturn push_buffer(GstreamerData *data, GstBuffer *buffer, int num_samples);
+
+  static gboolean resume_generator(std::shared_ptr<GeneratorSlot> *slot_ptr);
+
+  static gboolean generator_suspended(std::shared_ptr<GeneratorSlot> *slot_ptr);
+
+  static bool on_generator_suspend(const std::shared_ptr<GeneratorSlot> &slot);
+
   static void start_feed(GstElement *source, guint size, GstreamerData *data);
 
   static void stop_feed(GstElement *source, GstreamerData *data);
 
   static void error_cb(GstBus *bus, GstMessage *msg, GstreamerData *data);
+
+  static void eos_cb(GstBus *bus, GstMessage *msg, GstreamerData *data);
+
+  static void element_message_cb(GstBus *bus, GstMessage *msg, GstreamerData *data);
+
+  void create_archive_branch(const ArchiveOptions &options);
+
+  /**
+   * Sends EOS and waits (with a timeout) until splitmuxsink finalizes the last segment,
+   * a segment that is still open afterwards gets its close record anyway.
+   * It has to be called before the pipeline leaves the playing state.
+   */
+  void finish_archive();
+
+  /**
+   * Writes the opening or closing of a segment to the index and notifies ArchiveOptions::on_segment.
+   */
+  static void add_archive_record(ArchiveBranch &archive, bool opened, const std::string &location, std::chrono::system_clock::time_point time);
 };
 #endif // RTSP_PUSHER_HPP
\ No newline at end of file
@@ -0,0 +1,123 @@
+#include "../include/audio_generator.hpp"
+
+bool AudioGenerator::promise_type::NotifyingAwaiter::await_ready() const noexcept
+{
+  return false;
+}
+
+void AudioGenerator::promise_type::NotifyingAwaiter::await_suspend(std::coroutine_handle<promise_type> handle) const noexcept
+{
+  // Nothing may touch the frame (including this awaiter) once on_suspend returns:
+  // it may be resumed or destroyed on another thread right away, so the callback is called from a copy
+  const auto on_suspend = handle.promise().on_suspend;
+  if (on_suspend && !on_suspend())
+  {
+    handle.destroy();
+  }
+}
+
+void AudioGenerator::promise_type::NotifyingAwaiter::await_resume() const noexcept
+{
+}
+
+AudioGenerator AudioGenerator::promise_type::get_return_object()
+{
+  return AudioGenerator(std::coroutine_handle<promise_type>::from_promise(*this));
+}
+
+std::suspend_always AudioGenerator::promise_type::initial_suspend() noexcept
+{
+  return {};
+}
+
+AudioGenerator::promise_type::NotifyingAwaiter AudioGenerator::promise_type::final_suspend() noexcept
+{
+  return {};
+}
+
+AudioGenerator::promise_type::NotifyingAwaiter AudioGenerator::promise_type::yield_value(AudioChunk chunk)
+{
+  this->chunk = std::move(chunk);
+  return {};
+}
+
+void AudioGenerator::promise_type::return_void()
+{
+}
+
+void AudioGenerator::promise_type::unhandled_exception()
+{
+  exception = std::current_exception();
+}
+
+AudioGenerator::AudioGenerator(std::coroutine_handle<promise_type> handle) : handle(handle)
+{
+}
+
+AudioGenerator::AudioGenerator(AudioGenerator &&other) : handle(std::exchange(other.handle, nullptr))
+{
+}
+
+AudioGenerator &AudioGenerator::operator=(AudioGenerator &&other)
+{
+  if (this != &other)
+  {
+    if (handle)
+    {
+      handle.destroy();
+    }
+    handle = std::exchange(other.handle, nullptr);
+  }
+  return *this;
+}
+
+void AudioGenerator::resume()
+{
+  if (handle && !handle.done())
+  {
+    handle.resume();
+  }
+}
+
+bool AudioGenerator::done() const
+{
+  return !handle || handle.done();
+}
+
+std::optional<AudioChunk> AudioGenerator::take_chunk()
+{
+  if (!handle)
+  {
+    return std::nullopt;
+  }
+  return std::exchange(handle.promise().chunk, std::nullopt);
+}
+
+void AudioGenerator::rethrow_if_failed() const
+{
+  if (handle && handle.promise().exception)
+  {
+    std::rethrow_exception(handle.promise().exception);
+  }
+}
+
+void AudioGenerator::set_on_suspend(const std::function<bool()> &on_suspend)
+{
+  if (handle)
+  {
+    handle.promise().on_suspend = on_suspend;
+  }
+}
+
+void AudioGenerator::release()
+{
+  handle = nullptr;
+}
+
+AudioGenerator::~AudioGenerator()
+{
+  if (handle)
+  {
+    handle.destroy();
+  }
+}
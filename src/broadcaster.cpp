@@ -1,4 +1,12 @@
 #include "../include/broadcaster.hpp"
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <limits>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cctype>
 
 using httplib::StatusCode;
 using json = nlohmann::json;
@@ -20,6 +28,14 @@ nlohmann::json Client::to_json() const
       {"type", type}};
 }
 
+nlohmann::json Rendition::to_json() const
+{
+  return {
+      {"path", path},
+      {"bitrate", bitrate},
+      {"urls", urls.to_json()}};
+}
+
 nlohmann::json Room::to_json() const
 {
   nlohmann::json json;
@@ -31,10 +47,24 @@ nlohmann::json Room::to_json() const
   json["data_url"] = data_url;
   json["has_audio_data_provider"] = has_audio_data_provider;
   json["has_text_data_provider"] = has_text_data_provider;
+  json["renditions"] = nlohmann::json::array();
+  for (const auto &rendition : renditions)
+  {
+    json["renditions"].push_back(rendition.to_json());
+  }
   return json;
 }
 
-Broadcaster::Broadcaster(const std::string &media_server_api_url, bool start_http_server) : api_client(media_server_api_url)
+nlohmann::json KickReport::to_json() const
+{
+  return {
+      {"requested", requested},
+      {"kicked", kicked},
+      {"failed", failed},
+      {"latencyMs", latency.count()}};
+}
+
+Broadcaster::Broadcaster(const std::string &media_server_api_url, bool start_http_server) : media_server_api_url(media_server_api_url), api_client(media_server_api_url)
 {
   if (start_http_server)
   {
@@ -48,28 +78,13 @@ void Broadcaster::start_http_server(const std::string &ip, int port)
   {
     server_ip = ip;
     server_port = port;
-    server.Get("/v1/rooms", [this](const httplib::Request &, httplib::Response &res)
-               {
-                  const auto rooms = get_rooms();
-                  json response_json;
-                  json rooms_json = json::array();
-                  for (const auto &room : this->rooms)
-                  {
-                    const auto clients = get_connected_clients(room.first);
-                    const auto room_json = json{
-                        {"path", '/' + room.first},
-                        {"title", room.second.title},
-                        {"description", room.second.description},
-                        {"audioUrls", room.second.urls.to_json()},
-                        {"dataUrl", "http://" + server_ip + ':' +
-                                     std::to_string(server_port) +
-                                     "/v1/rooms/" + room.first + "/data"},
-                        {"currentClientsNumber", clients.size()},
-                        {"maxClientsNumber", room.second.max_readers}};
-                    rooms_json.push_back(room_json);
-        }
-          response_json["rooms"] = rooms_json;
-          res.set_content(response_json.dump(), "application/json"); });
+    for (const auto &room : rooms)
+    {
+      // dataUrl depends on the server address
+      update_room_json_cache(room.first);
+    }
+    server.Get("/v1/rooms", [this](const httplib::Request &req, httplib::Response &res)
+               { handle_get_rooms(req, res); });
 
     server.Get(R"(/v1/rooms/(\w+)/data)", [this](const httplib::Request &req, httplib::Response &res)
                {
@@ -96,6 +111,167 @@ void Broadcaster::start_http_server(const std::string &ip, int port)
   }
 }
 
+void Broadcaster::handle_get_rooms(const httplib::Request &req, httplib::Response &res)
+{
+  static const std::vector<std::string> all_fields = {"path", "title", "description", "audioUrls", "dataUrl", "currentClientsNumber", "maxClientsNumber", "renditions"};
+
+  auto prefix = req.get_param_value("prefix");
+  if (prefix.starts_with('/'))
+  {
+    prefix.erase(0, 1);
+  }
+  auto cursor = req.get_param_value("cursor");
+  if (cursor.starts_with('/'))
+  {
+    cursor.erase(0, 1);
+  }
+
+  size_t limit = std::numeric_limits<size_t>::max();
+  if (req.has_param("limit"))
+  {
+    try
+    {
+      const auto parsed_limit = std::stoi(req.get_param_value("limit"));
+      if (parsed_limit <= 0)
+      {
+        throw std::invalid_argument("limit");
+      }
+      limit = parsed_limit;
+    }
+    catch (const std::exception &e)
+    {
+      res.status = 400;
+      res.set_content(json{{"errorMessage", "limit must be a positive integer"}}.dump(), "application/json");
+      return;
+    }
+  }
+
+  std::set<std::string> fields;
+  if (req.has_param("fields"))
+  {
+    std::stringstream fields_stream(req.get_param_value("fields"));
+    std::string field;
+    while (std::getline(fields_stream, field, ','))
+    {
+      if (std::find(all_fields.begin(), all_fields.end(), field) == all_fields.end())
+      {
+        res.status = 400;
+        res.set_content(json{{"errorMessage", "Unknown field: " + field}}.dump(), "application/json");
+        return;
+      }
+      fields.insert(field);
+    }
+  }
+  const auto is_field_selected = [&fields](const std::string &field)
+  { return fields.empty() || fields.contains(field); };
+
+  // The reader counts of all rooms (with their renditions) come from a single listing of the media server
+  std::map<std::string, size_t> readers_numbers;
+  if (is_field_selected("currentClientsNumber"))
+  {
+    const auto reader_rooms = get_reader_rooms();
+    for (const auto &path_json : get_media_server_items("/v3/paths/list"))
+    {
+      const auto room = reader_rooms.find(path_json.value("name", ""));
+      if (room != reader_rooms.end())
+      {
+        readers_numbers[room->second] += path_json.contains("readers") ? path_json.at("readers").size() : 0;
+      }
+    }
+  }
+
+  // Only the shared snapshots of the page are copied under the lock, the body is built without it
+  std::vector<std::pair<std::string, std::shared_ptr<const RoomJsonFields>>> page;
+  bool has_next_page = false;
+  {
+    std::lock_guard<std::mutex> lock(rooms_json_mutex);
+    // rooms_json is sorted by path, so both the prefix and the cursor are a single lookup
+    auto room = cursor.empty() || cursor < prefix ? rooms_json.lower_bound(prefix) : rooms_json.upper_bound(cursor);
+    for (; room != rooms_json.end() && room->first.starts_with(prefix) && page.size() < limit; room++)
+    {
+      page.emplace_back(room->first, room->second);
+    }
+    has_next_page = room != rooms_json.end() && room->first.starts_with(prefix);
+  }
+
+  std::string body = "{\"rooms\":[";
+  for (size_t i = 0; i < page.size(); i++)
+  {
+    const auto &[path, fields] = page[i];
+    if (i > 0)
+    {
+      body += ',';
+    }
+    body += '{';
+    bool first_field = true;
+    for (const auto &field : *fields)
+    {
+      if (!is_field_selected(field.first))
+      {
+        continue;
+      }
+      if (!first_field)
+      {
+        body += ',';
+      }
+      // The only field that is not cached, its entry is a placeholder
+      if (field.first == "currentClientsNumber")
+      {
+        body += "\"currentClientsNumber\":" + std::to_string(readers_numbers[path]);
+      }
+      else
+      {
+        body += field.second;
+      }
+      first_field = false;
+    }
+    body += '}';
+  }
+  body += ']';
+  if (has_next_page)
+  {
+    body += ",\"nextCursor\":" + json('/' + page.back().first).dump();
+  }
+  body += '}';
+
+  // It is gzip-compressed by httplib when the client accepts it (see CPPHTTPLIB_ZLIB_SUPPORT)
+  res.set_content(body, "application/json");
+}
+
+void Broadcaster::update_room_json_cache(const std::string &path)
+{
+  if (!rooms.contains(path))
+  {
+    return;
+  }
+
+  auto &room = rooms.at(path);
+  json renditions_json = json::array();
+  for (const auto &rendition : room.renditions)
+  {
+    renditions_json.push_back(json{
+        {"path", '/' + rendition.path},
+        {"bitrate", rendition.bitrate},
+        {"audioUrls", rendition.urls.to_json()}});
+  }
+
+  const auto serialize_field = [](const std::string &key, const json &value)
+  { return std::make_pair(key, json(key).dump() + ':' + value.dump()); };
+  // Never modified once published, readers keep their own reference
+  const auto fields = std::make_shared<const RoomJsonFields>(RoomJsonFields{
+      serialize_field("path", '/' + path),
+      serialize_field("title", room.title),
+      serialize_field("description", room.description),
+      serialize_field("audioUrls", room.urls.to_json()),
+      serialize_field("dataUrl", "http://" + server_ip + ':' + std::to_string(server_port) + "/v1/rooms/" + path + "/data"),
+      {"currentClientsNumber", ""},
+      serialize_field("maxClientsNumber", room.max_readers),
+      serialize_field("renditions", renditions_json)});
+
+  std::lock_guard<std::mutex> lock(rooms_json_mutex);
+  rooms_json[path] = fields;
+}
+
 void Broadcaster::stop_http_server()
 {
   if (server.is_running())
@@ -108,15 +284,106 @@ void Broadcaster::stop_http_server()
   }
 }
 
-void Broadcaster::publish_audio(const std::string &path, const std::function<int(uint8_t *buffer, int chunk_size, int sample_rate)> &data_provider, GstAudioFormat audio_format, int chunk_size, int sample_rate)
+void Broadcaster::publish_audio(const std::string &path, const std::function<int(uint8_t *buffer, int chunk_size, int sample_rate)> &data_provider, GstAudioFormat audio_format, int chunk_size, int sample_rate, const std::vector<int> &bitrates)
+{
+  const auto outputs = prepare_audio_outputs(path, bitrates);
+
+  auto &room = rooms.at(path);
+  room.pusher = RtspPusher(outputs, data_provider, audio_format, chunk_size, sample_rate, get_room_archive_options(path));
+  room.pusher->start();
+}
+
+void Broadcaster::publish_audio(const std::string &path, AudioGenerator generator, GstAudioFormat audio_format, int sample_rate, const std::vector<int> &bitrates)
+{
+  const auto outputs = prepare_audio_outputs(path, bitrates);
+
+  auto &room = rooms.at(path);
+  room.pusher = RtspPusher(outputs, std::move(generator), audio_format, sample_rate, get_room_archive_options(path));
+  room.pusher->start();
+}
+
+std::vector<RtspPusher::Output> Broadcaster::prepare_audio_outputs(const std::string &path, const std::vector<int> &bitrates)
 {
+  // Validated before anything is created or unpublished
+  std::set<int> unique_bitrates;
+  for (const auto bitrate : bitrates)
+  {
+    // Range of opusenc bitrate (4000-650000 bps)
+    if (bitrate < 4 || bitrate > 650)
+    {
+      throw std::runtime_error("bitrate must be between 4 and 650 kbps");
+    }
+    if (!unique_bitrates.insert(bitrate).second)
+    {
+      throw std::runtime_error("Duplicate bitrate: " + std::to_string(bitrate));
+    }
+  }
+
   if (!does_room_exist(path))
   {
     create_new_room(path);
   }
+  // Drop the previous stream with its ladder sub-paths
+  unpublish_audio(path);
+
+  auto &room = rooms.at(path);
+  std::vector<RtspPusher::Output> outputs = {{"rtsp://localhost:8554/" + path, 0}};
+  if (!bitrates.empty())
+  {
+    const auto media_server_config = get_media_server_config();
+    for (const auto bitrate : bitrates)
+    {
+      const auto rendition_path = path + '/' + std::to_string(bitrate) + 'k';
+      append_to_snapshot(json{{"op", "rendition"}, {"path", rendition_path}});
+      add_media_server_path(rendition_path, room.max_readers);
+      set_rendition_room(rendition_path, path);
+      room.renditions.push_back(Rendition{rendition_path, bitrate, make_urls(media_server_config, rendition_path)});
+      outputs.push_back({"rtsp://localhost:8554/" + rendition_path, bitrate * 1000});
+    }
+  }
+
+  update_room_json_cache(path);
+  return outputs;
+}
+
+std::optional<RtspPusher::ArchiveOptions> Broadcaster::get_room_archive_options(const std::string &path) const
+{
+  if (!archive_options.has_value())
+  {
+    return std::nullopt;
+  }
+  auto room_archive_options = archive_options;
+  room_archive_options->directory = (std::filesystem::path(archive_options->directory) / path).string();
+  room_archive_options->on_segment = [index = archive_index, directory = room_archive_options->directory, on_segment = archive_options->on_segment](const RtspPusher::ArchiveSegment &segment)
+  {
+    update_archive_index(*index, directory, segment);
+    if (on_segment)
+    {
+      on_segment(segment);
+    }
+  };
+  return room_archive_options;
+}
 
-  rooms[path].pusher = std::move(RtspPusher("rtsp://localhost:8554/" + path, data_provider, audio_format, chunk_size, sample_rate));
-  rooms[path].pusher->start();
+void Broadcaster::update_archive_index(ArchiveIndex &index, const std::string &directory, const RtspPusher::ArchiveSegment &segment)
+{
+  std::lock_guard<std::mutex> lock(index.mutex);
+  auto segments = index.segments.find(directory);
+  if (segments == index.segments.end())
+  {
+    return; // It's read from the index file on the first lookup
+  }
+  // The segment may already be there if the directory was loaded after its record was written
+  const auto existing = std::find_if(segments->second.rbegin(), segments->second.rend(), [&segment](const RtspPusher::ArchiveSegment &other)
+                                     { return other.location == segment.location; });
+  if (existing != segments->second.rend())
+  {
+    existing->end_time = segment.end_time;
+    return;
+  }
+  const auto position = std::upper_bound(segments->second.begin(), segments->second.end(), segment.start_time, [](std::chrono::system_clock::time_point time, const RtspPusher::ArchiveSegment &other)
+                                         { return time < other.start_time; });
+  segments->second.insert(position, segment);
 }
 
 void Broadcaster::unpublish_audio(const std::string &path)
@@ -128,7 +395,17 @@ void Broadcaster::unpublish_audio(const std::string &path)
 
   if (rooms.contains(path))
   {
-    rooms.at(path).pusher = std::nullopt;
+    auto &room = rooms.at(path);
+    room.pusher = std::nullopt;
+    for (const auto &rendition : room.renditions)
+    {
+      append_to_snapshot(json{{"op", "delete"}, {"path", rendition.path}});
+      delete_media_server_path(rendition.path);
+      set_rendition_room(rendition.path, std::nullopt);
+    }
+    room.renditions.clear();
+    update_room_json_cache(path);
+    compact_snapshot_if_needed();
   }
 }
 
@@ -157,43 +434,112 @@ void Broadcaster::unpublish_text_data(const std::string &path)
 
 void Broadcaster::kick_client(const std::string &client_id)
 {
-  for (const auto &room : rooms)
+  std::optional<ClientLocation> location;
+  for (int attempt = 0; attempt < 2 && !location.has_value(); attempt++)
+  {
+    if (attempt > 0)
+    {
+      refresh_client_index(api_client);
+    }
+    std::lock_guard<std::mutex> lock(client_index_mutex);
+    if (client_index.contains(client_id))
+    {
+      location = client_index.at(client_id);
+    }
+  }
+  if (!location.has_value())
+  {
+    return;
+  }
+
+  // A stale entry (the client disconnected since the last refresh) is answered with 404 and just dropped
+  kick(api_client, Client{client_id, location->type});
+
+  std::lock_guard<std::mutex> lock(client_index_mutex);
+  client_index.erase(client_id);
+}
+
+KickReport Broadcaster::kick_room_clients(const std::string &path)
+{
+  const auto reader_rooms = get_reader_rooms();
+  return kick_clients([&path, &reader_rooms](const std::string &client_path, const Client &)
+                      { return client_path == path || (reader_rooms.contains(client_path) && reader_rooms.at(client_path) == path); });
+}
+
+KickReport Broadcaster::kick_clients(const std::function<bool(const std::string &path, const Client &client)> &predicate)
+{
+  const auto start_time = std::chrono::steady_clock::now();
+  std::vector<Client> targets;
+  for (const auto &[path, clients] : refresh_client_index(api_client))
   {
-    const auto clients = get_connected_clients(room.first);
     for (const auto &client : clients)
     {
-      if (client.id == client_id)
+      if (predicate(path, client))
       {
-        httplib::Result res;
-        if (client.type == "rtspSession")
-        {
-          res = api_client.Post("/v3/rtspsessions/kick/" + client_id);
-        }
-        else if (client.type == "rtmpConn")
-        {
-          res = api_client.Post("/v3/rtmpconns/kick/" + client_id);
-        }
-        else if (client.type == "webrtcSession")
-        {
-          res = api_client.Post("/v3/webrtcsessions/kick/" + client_id);
-        }
-        else if (client.type == "srtConn")
-        {
-          res = api_client.Post("/v3/srtconns/kick/" + client_id);
-        }
-        if (!res)
-        {
-          throw std::runtime_error("Http error: " + httplib::to_string(res.error()));
-        }
-        if (!(res->status == StatusCode::OK_200))
-        {
-          throw std::runtime_error(std::to_string(res->status) + " " + json::parse(res->body).value("error", ""));
-        }
-        return;
+        targets.push_back(client);
+      }
+    }
+  }
+  return kick_many(targets, start_time);
+}
+
+void Broadcaster::start_client_monitor(std::chrono::milliseconds refresh_interval)
+{
+  std::lock_guard<std::mutex> lock(client_monitor_mutex);
+  if (client_monitor_running)
+  {
+    return;
+  }
+  client_monitor_running = true;
+  client_monitor_thread = std::thread([this, refresh_interval]()
+                                      {
+    httplib::Client client(media_server_api_url);
+    std::unique_lock<std::mutex> lock(client_monitor_mutex);
+    while (client_monitor_running)
+    {
+      lock.unlock();
+      try
+      {
+        enforce_client_policies(client);
+      }
+      catch (const std::exception &e)
+      {
+        std::cerr << "Could not enforce client policies: " << e.what() << '\n';
       }
+      lock.lock();
+      client_monitor_cv.wait_for(lock, refresh_interval, [this]()
+                                 { return !client_monitor_running; });
+    } });
+}
+
+void Broadcaster::stop_client_monitor()
+{
+  {
+    std::lock_guard<std::mutex> lock(client_monitor_mutex);
+    if (!client_monitor_running)
+    {
+      return;
     }
+    client_monitor_running = false;
+  }
+  client_monitor_cv.notify_all();
+  if (client_monitor_thread.joinable())
+  {
+    client_monitor_thread.join();
   }
-  return;
+}
+
+Broadcaster *Broadcaster::set_client_policy(const std::function<bool(const std::string &path, const Client &client)> &policy)
+{
+  std::lock_guard<std::mutex> lock(client_index_mutex);
+  client_policy = policy;
+  return this;
+}
+
+KickReport Broadcaster::get_last_enforcement_report()
+{
+  std::lock_guard<std::mutex> lock(client_index_mutex);
+  return last_enforcement_report;
 }
 
 std::vector<Room> Broadcaster::get_rooms()
@@ -201,7 +547,7 @@ std::vector<Room> Broadcaster::get_rooms()
   std::vector<Room> rooms = {};
   for (const auto &room : this->rooms)
   {
-    rooms.emplace_back(Room{room.first, room.second.title, room.second.description, room.second.max_readers, room.second.urls, room.second.data_url, room.second.pusher.has_value(), room.second.text_data_provider.has_value()});
+    rooms.emplace_back(Room{room.first, room.second.title, room.second.description, room.second.max_readers, room.second.urls, room.second.data_url, room.second.pusher.has_value(), room.second.text_data_provider.has_value(), room.second.renditions});
   }
   return rooms;
 }
@@ -258,54 +604,25 @@ void Broadcaster::create_new_room(const std::string &path, const std::string &ti
     throw std::runtime_error("max_readers must be >= 0");
   }
 
-  const auto res = api_client.Post("/v3/config/paths/add/" + path, json{{"sourceOnDemand", false}, {"maxReaders", max_readers}}.dump(), "application/json");
-
-  if (!res)
-  {
-    throw std::runtime_error("Http error: " + httplib::to_string(res.error()));
-  }
-  // 400 means that the room already exists
-  if (!(res->status == StatusCode::OK_200) && !(res->status == StatusCode::BadRequest_400))
-  {
-    throw std::runtime_error(std::to_string(res->status) + " " + json::parse(res->body).value("error", ""));
-  }
-
-  const auto prefixes_res = api_client.Get("/v3/config/global/get");
-  if (!prefixes_res)
-  {
-    throw std::runtime_error("Http error: " + httplib::to_string(prefixes_res.error()));
-  }
-  if (prefixes_res->status != StatusCode::OK_200)
-  {
-    throw std::runtime_error(std::to_string(prefixes_res->status) + " " + json::parse(prefixes_res->body).value("error", ""));
-  }
-
-  auto urls = Urls();
+  // Journaled before the media server is touched, so restore_rooms() knows about the path even after a crash
+  append_to_snapshot(json{{"op", "create"}, {"path", path}, {"title", title}, {"description", description}, {"max_readers", max_readers}});
+  Urls urls;
   try
   {
-    const auto parsed_prefixes = json::parse(prefixes_res->body);
-    const auto ip = api_client.host();
-    const auto rtsp_prefix = "rtsp://" + ip + static_cast<std::string>(parsed_prefixes.at("rtspAddress")) + "/";
-    const auto rtmp_prefix = "rtmp://" + ip + static_cast<std::string>(parsed_prefixes.at("rtmpAddress")) + "/";
-    const auto hls_prefix = "http://" + ip + static_cast<std::string>(parsed_prefixes.at("hlsAddress")) + "/";
-    const auto hls_postfix = "/index.m3u8";
-    const auto webrtc_prefix = "http://" + ip + static_cast<std::string>(parsed_prefixes.at("webrtcAddress")) + "/";
-    const auto srt_prefix = "srt://" + ip + static_cast<std::string>(parsed_prefixes.at("srtAddress")) + "?streamid=read:";
-
-    urls.rtsp = rtsp_prefix + path;
-    urls.rtmp = rtmp_prefix + path;
-    urls.hls = hls_prefix + path + hls_postfix;
-    urls.webrtc = webrtc_prefix + path;
-    urls.srt = srt_prefix + path;
+    add_media_server_path(path, max_readers);
+    urls = make_urls(get_media_server_config(), path);
   }
   catch (const std::exception &e)
   {
-    throw std::runtime_error("Invalid json");
+    append_to_snapshot(json{{"op", "delete"}, {"path", path}});
+    throw;
   }
 
   const auto data_url = server_ip + ':' + std::to_string(server_port) + "/v1/rooms/" + path + "/data";
 
-  rooms.try_emplace(path, RoomData{title, description, max_readers, urls, data_url, std::nullopt, std::nullopt});
+  rooms.try_emplace(path, RoomData{title, description, max_readers, urls, data_url, {}, std::nullopt, std::nullopt});
+  update_room_json_cache(path);
+  set_reader_limit(path, max_readers);
 }
 
 void Broadcaster::delete_room(const std::string &path)
@@ -318,17 +635,674 @@ void Broadcaster::delete_room(const std::string &path)
   unpublish_audio(path);
   unpublish_text_data(path);
 
-  const auto res = api_client.Delete("/v3/config/paths/delete/" + path);
-  if (!res)
+  append_to_snapshot(json{{"op", "delete"}, {"path", path}});
+  delete_media_server_path(path);
+
+  rooms.erase(path);
   {
-    throw std::runtime_error("Http error: " + httplib::to_string(res.error()));
+    std::lock_guard<std::mutex> lock(rooms_json_mutex);
+    rooms_json.erase(path);
   }
-  if (!(res->status == StatusCode::OK_200))
+  set_reader_limit(path, std::nullopt);
+  compact_snapshot_if_needed();
+}
+
+Broadcaster *Broadcaster::set_snapshot_path(const std::string &snapshot_path)
+{
+  this->snapshot_path = snapshot_path;
+  // Entries left by earlier runs count towards the compaction too
+  snapshot_entries = 0;
+  std::ifstream snapshot_file(snapshot_path);
+  std::string line;
+  while (std::getline(snapshot_file, line))
   {
-    throw std::runtime_error(std::to_string(res->status) + " " + json::parse(res->body).value("error", ""));
+    snapshot_entries++;
   }
+  return this;
+}
 
-  rooms.erase(path);
+std::string Broadcaster::get_snapshot_path() const
+{
+  return snapshot_path;
+}
+
+void Broadcaster::restore_rooms()
+{
+  if (snapshot_path.empty())
+  {
+    throw std::runtime_error("Snapshot path is not set");
+  }
+  if (!std::filesystem::exists(snapshot_path))
+  {
+    return;
+  }
+
+  // Replay the journal: the last entry for a path wins
+  std::map<std::string, json> snapshot_rooms;
+  std::set<std::string> owned_paths;
+  {
+    std::ifstream snapshot_file(snapshot_path);
+    std::string line;
+    while (std::getline(snapshot_file, line))
+    {
+      try
+      {
+        const auto entry = json::parse(line);
+        const std::string path = entry.at("path");
+        const std::string op = entry.at("op");
+        owned_paths.insert(path);
+        if (op == "create")
+        {
+          snapshot_rooms[path] = entry;
+        }
+        else if (op == "delete")
+        {
+          snapshot_rooms.erase(path);
+        }
+      }
+      catch (const std::exception &e)
+      {
+        // A torn last line (e.g. crash while appending) is skipped
+        continue;
+      }
+    }
+  }
+
+  std::map<std::string, int> media_server_paths; // Path -> maxReaders
+  for (const auto &path_json : get_media_server_items("/v3/config/paths/list"))
+  {
+    media_server_paths[path_json.value("name", "")] = path_json.value("maxReaders", 0);
+  }
+
+  const auto media_server_config = get_media_server_config();
+  for (const auto &[path, entry] : snapshot_rooms)
+  {
+    if (does_room_exist(path))
+    {
+      continue;
+    }
+    const int max_readers = entry.value("max_readers", 0);
+    if (!media_server_paths.contains(path))
+    {
+      add_media_server_path(path, max_readers);
+    }
+    else if (media_server_paths.at(path) != max_readers)
+    {
+      update_media_server_path(path, max_readers);
+    }
+    const auto data_url = server_ip + ':' + std::to_string(server_port) + "/v1/rooms/" + path + "/data";
+    rooms.try_emplace(path, RoomData{entry.value("title", ""), entry.value("description", ""), max_readers, make_urls(media_server_config, path), data_url, {}, std::nullopt, std::nullopt});
+    update_room_json_cache(path);
+    set_reader_limit(path, max_readers);
+  }
+
+  // The rooms together with the bitrate ladders they are publishing right now
+  std::set<std::string> live_paths;
+  for (const auto &[path, room] : rooms)
+  {
+    live_paths.insert(path);
+    for (const auto &rendition : room.renditions)
+    {
+      live_paths.insert(rendition.path);
+    }
+  }
+  for (const auto &[path, _] : media_server_paths)
+  {
+    if (owned_paths.contains(path) && !live_paths.contains(path))
+    {
+      delete_media_server_path(path);
+    }
+  }
+
+  write_snapshot();
+}
+
+json Broadcaster::get_media_server_config()
+{
+  const auto res = api_client.Get("/v3/config/global/get");
+  if (!res)
+  {
+    throw std::runtime_error("Http error: " + httplib::to_string(res.error()));
+  }
+  if (res->status != StatusCode::OK_200)
+  {
+    throw std::runtime_error(std::to_string(res->status) + " " + json::parse(res->body).value("error", ""));
+  }
+
+  try
+  {
+    return json::parse(res->body);
+  }
+  catch (const std::exception &e)
+  {
+    throw std::runtime_error("Invalid json");
+  }
+}
+
+Urls Broadcaster::make_urls(const json &media_server_config, const std::string &path) const
+{
+  auto urls = Urls();
+  try
+  {
+    const auto ip = api_client.host();
+    const auto rtsp_prefix = "rtsp://" + ip + static_cast<std::string>(media_server_config.at("rtspAddress")) + "/";
+    const auto rtmp_prefix = "rtmp://" + ip + static_cast<std::string>(media_server_config.at("rtmpAddress")) + "/";
+    const auto hls_prefix = "http://" + ip + static_cast<std::string>(media_server_config.at("hlsAddress")) + "/";
+    const auto hls_postfix = "/index.m3u8";
+    const auto webrtc_prefix = "http://" + ip + static_cast<std::string>(media_server_config.at("webrtcAddress")) + "/";
+    const auto srt_prefix = "srt://" + ip + static_cast<std::string>(media_server_config.at("srtAddress")) + "?streamid=read:";
+
+    urls.rtsp = rtsp_prefix + path;
+    urls.rtmp = rtmp_prefix + path;
+    urls.hls = hls_prefix + path + hls_postfix;
+    urls.webrtc = webrtc_prefix + path;
+    urls.srt = srt_prefix + path;
+  }
+  catch (const std::exception &e)
+  {
+    throw std::runtime_error("Invalid json");
+  }
+  return urls;
+}
+
+void Broadcaster::add_media_server_path(const std::string &path, int max_readers)
+{
+  const auto res = api_client.Post("/v3/config/paths/add/" + path, json{{"sourceOnDemand", false}, {"maxReaders", max_readers}}.dump(), "application/json");
+
+  if (!res)
+  {
+    throw std::runtime_error("Http error: " + httplib::to_string(res.error()));
+  }
+  // 400 means that the path already exists
+  if (!(res->status == StatusCode::OK_200) && !(res->status == StatusCode::BadRequest_400))
+  {
+    throw std::runtime_error(std::to_string(res->status) + " " + json::parse(res->body).value("error", ""));
+  }
+}
+
+void Broadcaster::update_media_server_path(const std::string &path, int max_readers)
+{
+  const auto res = api_client.Patch("/v3/config/paths/patch/" + path, json{{"maxReaders", max_readers}}.dump(), "application/json");
+  if (!res)
+  {
+    throw std::runtime_error("Http error: " + httplib::to_string(res.error()));
+  }
+  if (!(res->status == StatusCode::OK_200))
+  {
+    throw std::runtime_error(std::to_string(res->status) + " " + json::parse(res->body).value("error", ""));
+  }
+}
+
+void Broadcaster::delete_media_server_path(const std::string &path)
+{
+  const auto res = api_client.Delete("/v3/config/paths/delete/" + path);
+  if (!res)
+  {
+    throw std::runtime_error("Http error: " + httplib::to_string(res.error()));
+  }
+  if (!(res->status == StatusCode::OK_200))
+  {
+    throw std::runtime_error(std::to_string(res->status) + " " + json::parse(res->body).value("error", ""));
+  }
+}
+
+json Broadcaster::get_media_server_items(httplib::Client &client, const std::string &endpoint)
+{
+  auto items = json::array();
+  int page = 0;
+  int page_count = 1;
+  while (page < page_count)
+  {
+    const auto res = client.Get(endpoint + "?itemsPerPage=10000&page=" + std::to_string(page));
+    if (!res)
+    {
+      throw std::runtime_error("Http error: " + httplib::to_string(res.error()));
+    }
+    if (res->status != StatusCode::OK_200)
+    {
+      throw std::runtime_error(std::to_string(res->status) + " " + json::parse(res->body).value("error", ""));
+    }
+
+    try
+    {
+      const auto parsed_res = json::parse(res->body);
+      for (const auto &item : parsed_res.at("items"))
+      {
+        items.push_back(item);
+      }
+      page_count = parsed_res.value("pageCount", 0);
+    }
+    catch (const std::exception &e)
+    {
+      throw std::runtime_error("Invalid response json from the media server");
+    }
+    page++;
+  }
+  return items;
+}
+
+json Broadcaster::get_media_server_items(const std::string &endpoint)
+{
+  return get_media_server_items(api_client, endpoint);
+}
+
+std::map<std::string, std::vector<Client>> Broadcaster::refresh_client_index(httplib::Client &client)
+{
+  std::map<std::string, std::vector<Client>> readers;
+  std::unordered_map<std::string, ClientLocation> new_client_index;
+  try
+  {
+    for (const auto &path_json : get_media_server_items(client, "/v3/paths/list"))
+    {
+      const std::string path = path_json.at("name");
+      auto &path_readers = readers[path];
+      for (const auto &reader_json : path_json.at("readers"))
+      {
+        path_readers.push_back({reader_json.at("id"), reader_json.at("type")});
+        new_client_index[path_readers.back().id] = {path, path_readers.back().type};
+      }
+    }
+  }
+  catch (const std::runtime_error &e)
+  {
+    throw;
+  }
+  catch (const std::exception &e)
+  {
+    throw std::runtime_error("Invalid response json from the media server");
+  }
+
+  std::lock_guard<std::mutex> lock(client_index_mutex);
+  client_index = std::move(new_client_index);
+  return readers;
+}
+
+KickReport Broadcaster::kick_many(const std::vector<Client> &clients, std::chrono::steady_clock::time_point start_time)
+{
+  const size_t max_workers = 8;
+  std::atomic<size_t> next_client = 0;
+  std::atomic<size_t> kicked = 0;
+  std::atomic<size_t> failed = 0;
+
+  std::vector<std::future<void>> workers;
+  for (size_t i = 0; i < std::min(max_workers, clients.size()); i++)
+  {
+    workers.push_back(std::async(std::launch::async, [&]()
+                                 {
+      httplib::Client client(media_server_api_url);
+      for (size_t j = next_client++; j < clients.size(); j = next_client++)
+      {
+        try
+        {
+          kick(client, clients[j]);
+          kicked++;
+        }
+        catch (const std::exception &e)
+        {
+          failed++;
+        }
+      } }));
+  }
+  for (auto &worker : workers)
+  {
+    worker.wait();
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(client_index_mutex);
+    for (const auto &client : clients)
+    {
+      client_index.erase(client.id);
+    }
+  }
+
+  return KickReport{clients.size(), kicked, failed, std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start_time)};
+}
+
+bool Broadcaster::kick(httplib::Client &client, const Client &target)
+{
+  httplib::Result res;
+  if (target.type == "rtspSession")
+  {
+    res = client.Post("/v3/rtspsessions/kick/" + target.id);
+  }
+  else if (target.type == "rtmpConn")
+  {
+    res = client.Post("/v3/rtmpconns/kick/" + target.id);
+  }
+  else if (target.type == "webrtcSession")
+  {
+    res = client.Post("/v3/webrtcsessions/kick/" + target.id);
+  }
+  else if (target.type == "srtConn")
+  {
+    res = client.Post("/v3/srtconns/kick/" + target.id);
+  }
+  else
+  {
+    throw std::runtime_error("Unsupported client type: " + target.type);
+  }
+  if (!res)
+  {
+    throw std::runtime_error("Http error: " + httplib::to_string(res.error()));
+  }
+  // 404 means that the client has already disconnected
+  if (res->status == StatusCode::NotFound_404)
+  {
+    return false;
+  }
+  if (!(res->status == StatusCode::OK_200))
+  {
+    throw std::runtime_error(std::to_string(res->status) + " " + json::parse(res->body).value("error", ""));
+  }
+  return true;
+}
+
+std::unordered_map<std::string, std::chrono::system_clock::time_point> Broadcaster::get_connection_times(httplib::Client &client, const std::set<std::string> &types)
+{
+  static const std::map<std::string, std::string> list_endpoints = {
+      {"rtspSession", "/v3/rtspsessions/list"},
+      {"rtmpConn", "/v3/rtmpconns/list"},
+      {"webrtcSession", "/v3/webrtcsessions/list"},
+      {"srtConn", "/v3/srtconns/list"}};
+
+  std::unordered_map<std::string, std::chrono::system_clock::time_point> connection_times;
+  for (const auto &type : types)
+  {
+    if (!list_endpoints.contains(type))
+    {
+      continue;
+    }
+    try
+    {
+      for (const auto &item : get_media_server_items(client, list_endpoints.at(type)))
+      {
+        const auto created = parse_media_server_time(item.value("created", ""));
+        if (created.has_value())
+        {
+          connection_times[item.value("id", "")] = created.value();
+        }
+      }
+    }
+    catch (const std::exception &e)
+    {
+      // The limit is still enforced, only the choice of the kicked readers is arbitrary
+      std::cerr << "Could not list the connection times of " << type << " clients: " << e.what() << '\n';
+    }
+  }
+  return connection_times;
+}
+
+std::optional<std::chrono::system_clock::time_point> Broadcaster::parse_media_server_time(const std::string &time)
+{
+  // RFC 3339 as written by Go, e.g. 2024-01-02T15:04:05.123456789+01:00 (the fraction is optional and has no trailing zeros)
+  int year, month, day, hours, minutes, seconds;
+  int consumed = 0;
+  if (std::sscanf(time.c_str(), "%4d-%2d-%2dT%2d:%2d:%2d%n", &year, &month, &day, &hours, &minutes, &seconds, &consumed) != 6)
+  {
+    return std::nullopt;
+  }
+  size_t position = consumed;
+
+  std::chrono::nanoseconds fraction(0);
+  if (position < time.size() && time[position] == '.')
+  {
+    std::string digits;
+    for (position++; position < time.size() && std::isdigit(static_cast<unsigned char>(time[position])); position++)
+    {
+      digits += time[position];
+    }
+    if (digits.empty())
+    {
+      return std::nullopt;
+    }
+    digits.resize(9, '0'); // Nanoseconds
+    fraction = std::chrono::nanoseconds(std::stoll(digits));
+  }
+
+  std::chrono::minutes offset(0);
+  if (position < time.size() && (time[position] == '+' || time[position] == '-'))
+  {
+    int offset_hours, offset_minutes;
+    if (std::sscanf(time.c_str() + position + 1, "%2d:%2d", &offset_hours, &offset_minutes) != 2)
+    {
+      return std::nullopt;
+    }
+    offset = std::chrono::minutes(offset_hours * 60 + offset_minutes) * (time[position] == '-' ? -1 : 1);
+  }
+  else if (position >= time.size() || time[position] != 'Z')
+  {
+    return std::nullopt;
+  }
+
+  const auto date = std::chrono::year_month_day(std::chrono::year(year), std::chrono::month(month), std::chrono::day(day));
+  if (!date.ok())
+  {
+    return std::nullopt;
+  }
+  return std::chrono::time_point_cast<std::chrono::system_clock::duration>(
+      std::chrono::sys_days(date) + std::chrono::hours(hours) + std::chrono::minutes(minutes) + std::chrono::seconds(seconds) +
+      std::chrono::duration_cast<std::chrono::system_clock::duration>(fraction) - offset);
+}
+
+void Broadcaster::set_reader_limit(const std::string &path, std::optional<int> max_readers)
+{
+  std::lock_guard<std::mutex> lock(client_index_mutex);
+  if (max_readers.has_value())
+  {
+    reader_limits[path] = max_readers.value();
+    reader_rooms[path] = path;
+  }
+  else
+  {
+    reader_limits.erase(path);
+    std::erase_if(reader_rooms, [&path](const auto &reader_room)
+                  { return reader_room.second == path; });
+  }
+}
+
+void Broadcaster::set_rendition_room(const std::string &rendition_path, const std::optional<std::string> &room)
+{
+  std::lock_guard<std::mutex> lock(client_index_mutex);
+  if (room.has_value())
+  {
+    reader_rooms[rendition_path] = room.value();
+  }
+  else
+  {
+    reader_rooms.erase(rendition_path);
+  }
+}
+
+std::map<std::string, std::string> Broadcaster::get_reader_rooms()
+{
+  std::lock_guard<std::mutex> lock(client_index_mutex);
+  return reader_rooms;
+}
+
+void Broadcaster::enforce_client_policies(httplib::Client &client)
+{
+  const auto start_time = std::chrono::steady_clock::now();
+  const auto readers = refresh_client_index(client);
+
+  // Copied so the policy runs without the lock, it may call back into the broadcaster
+  std::map<std::string, int> limits;
+  std::map<std::string, std::string> rooms_of_paths;
+  std::function<bool(const std::string &path, const Client &client)> policy;
+  {
+    std::lock_guard<std::mutex> lock(client_index_mutex);
+    limits = reader_limits;
+    rooms_of_paths = reader_rooms;
+    policy = client_policy;
+  }
+
+  // The limit covers the whole room, the readers of the renditions are counted together with the default stream
+  std::map<std::string, std::vector<std::pair<std::string, Client>>> room_readers;
+  for (const auto &[path, clients] : readers)
+  {
+    // Paths that were not created by us are left alone
+    if (!rooms_of_paths.contains(path))
+    {
+      continue;
+    }
+    auto &readers_of_room = room_readers[rooms_of_paths.at(path)];
+    for (const auto &client : clients)
+    {
+      readers_of_room.emplace_back(path, client);
+    }
+  }
+
+  const auto get_limit = [&limits](const std::string &room)
+  { return limits.contains(room) ? limits.at(room) : 0; };
+
+  // The media server lists the readers of a path in no particular order (and it changes between listings),
+  // so the readers of rooms over their limit are ordered by their connection time, fetched only for the types involved
+  std::set<std::string> types_over_limit;
+  for (const auto &[room, clients] : room_readers)
+  {
+    const auto limit = get_limit(room);
+    if (limit > 0 && clients.size() > static_cast<size_t>(limit))
+    {
+      for (const auto &client : clients)
+      {
+        types_over_limit.insert(client.second.type);
+      }
+    }
+  }
+  const auto connection_times = types_over_limit.empty() ? std::unordered_map<std::string, std::chrono::system_clock::time_point>{} : get_connection_times(client, types_over_limit);
+  const auto get_connection_time = [&connection_times](const std::pair<std::string, Client> &reader)
+  {
+    // Unknown ones (e.g. connected after the listing) are treated as the newest
+    const auto time = connection_times.find(reader.second.id);
+    return time != connection_times.end() ? time->second : std::chrono::system_clock::time_point::max();
+  };
+
+  std::vector<Client> targets;
+  for (auto &[room, clients] : room_readers)
+  {
+    const auto limit = get_limit(room);
+    if (limit > 0 && clients.size() > static_cast<size_t>(limit))
+    {
+      std::stable_sort(clients.begin(), clients.end(), [&get_connection_time](const std::pair<std::string, Client> &a, const std::pair<std::string, Client> &b)
+                       { return get_connection_time(a) < get_connection_time(b); });
+    }
+    for (size_t i = 0; i < clients.size(); i++)
+    {
+      // The readers that connected last are kicked when the room is over its limit
+      const bool over_limit = limit > 0 && i >= static_cast<size_t>(limit);
+      if (over_limit || (policy && !policy(clients[i].first, clients[i].second)))
+      {
+        targets.push_back(clients[i].second);
+      }
+    }
+  }
+
+  if (targets.empty())
+  {
+    return;
+  }
+  auto report = kick_many(targets, start_time);
+  std::lock_guard<std::mutex> lock(client_index_mutex);
+  last_enforcement_report = report;
+}
+
+void Broadcaster::append_to_snapshot(const json &entry)
+{
+  if (snapshot_path.empty())
+  {
+    return;
+  }
+
+  std::ofstream snapshot_file(snapshot_path, std::ios::app);
+  snapshot_file << entry.dump() << '\n';
+  snapshot_file.flush();
+  if (!snapshot_file)
+  {
+    throw std::runtime_error("Could not write to the snapshot file " + snapshot_path);
+  }
+  snapshot_entries++;
+}
+
+void Broadcaster::write_snapshot()
+{
+  if (snapshot_path.empty())
+  {
+    return;
+  }
+
+  // Written next to the snapshot and renamed over it, so a crash never leaves it half written
+  const auto tmp_path = snapshot_path + ".tmp";
+  size_t entries = 0;
+  {
+    std::ofstream snapshot_file(tmp_path, std::ios::trunc);
+    for (const auto &room : rooms)
+    {
+      snapshot_file << json{{"op", "create"}, {"path", room.first}, {"title", room.second.title}, {"description", room.second.description}, {"max_readers", room.second.max_readers}}.dump() << '\n';
+      entries++;
+      for (const auto &rendition : room.second.renditions)
+      {
+        snapshot_file << json{{"op", "rendition"}, {"path", rendition.path}}.dump() << '\n';
+        entries++;
+      }
+    }
+    snapshot_file.flush();
+    if (!snapshot_file)
+    {
+      throw std::runtime_error("Could not write to the snapshot file " + tmp_path);
+    }
+  }
+  std::filesystem::rename(tmp_path, snapshot_path);
+  snapshot_entries = entries;
+}
+
+void Broadcaster::compact_snapshot_if_needed()
+{
+  size_t live_entries = rooms.size();
+  for (const auto &room : rooms)
+  {
+    live_entries += room.second.renditions.size();
+  }
+  // Every republish of a ladder appends its renditions and their deletes, so a long running process would grow it forever
+  if (snapshot_path.empty() || snapshot_entries <= 2 * live_entries + 1000)
+  {
+    return;
+  }
+  try
+  {
+    write_snapshot();
+  }
+  catch (const std::exception &e)
+  {
+    // The journal is still valid, it's compacted next time
+    std::cerr << "Could not compact the snapshot file: " << e.what() << '\n';
+  }
+}
+
+Broadcaster *Broadcaster::set_archive_options(const std::optional<RtspPusher::ArchiveOptions> &options)
+{
+  // Checked by the pusher too, but here it fails before any room is published
+  if (options.has_value() && options->max_queued_buffers == 0)
+  {
+    throw std::runtime_error("max_queued_buffers of the archive must be at least 1");
+  }
+  archive_options = options;
+  return this;
+}
+
+std::optional<RtspPusher::ArchiveSegment> Broadcaster::find_archived_segment(const std::string &path, std::chrono::system_clock::time_point time)
+{
+  const auto room_archive_options = get_room_archive_options(path);
+  if (!room_archive_options.has_value())
+  {
+    return std::nullopt;
+  }
+  std::lock_guard<std::mutex> lock(archive_index->mutex);
+  auto segments = archive_index->segments.find(room_archive_options->directory);
+  if (segments == archive_index->segments.end())
+  {
+    segments = archive_index->segments.emplace(room_archive_options->directory, RtspPusher::load_archive_segments(room_archive_options->directory)).first;
+  }
+  return RtspPusher::find_archive_segment(segments->second, time);
 }
 
 Broadcaster *Broadcaster::set_delete_rooms_in_destructor(bool delete_rooms_in_destructor)
@@ -370,6 +1344,7 @@ Broadcaster::~Broadcaster()
     }
   }
 
+  stop_client_monitor();
   api_client.stop();
   stop_http_server();
 }
@@ -1,13 +1,44 @@
 #include "../include/rtsp_pusher.hpp"
+#include <filesystem>
+#include <fstream>
+#include <algorithm>
+#include <chrono>
 
-RtspPusher::RtspPusher(const std::string &rtsp_url, const std::function<int(uint8_t *buffer, int chunk_size, int sample_rate)> &data_provider, GstAudioFormat audio_format, int chunk_size, int sample_rate) : data_ptr(std::make_unique<GstreamerData>())
+RtspPusher::RtspPusher(const std::string &rtsp_url, const std::function<int(uint8_t *buffer, int chunk_size, int sample_rate)> &data_provider, GstAudioFormat audio_format, int chunk_size, int sample_rate) : RtspPusher(std::vector<Output>{{rtsp_url, 0}}, data_provider, audio_format, chunk_size, sample_rate)
 {
-  gst_init(nullptr, nullptr);
+}
 
-  data_ptr->rtsp_url = rtsp_url;
+RtspPusher::RtspPusher(const std::vector<Output> &outputs, const std::function<int(uint8_t *buffer, int chunk_size, int sample_rate)> &data_provider, GstAudioFormat audio_format, int chunk_size, int sample_rate, const std::optional<ArchiveOptions> &archive) : data_ptr(std::make_unique<GstreamerData>())
+{
   data_ptr->data_provider = data_provider;
   data_ptr->chunk_size = chunk_size;
   data_ptr->sample_rate = sample_rate;
+  build_pipeline(outputs, audio_format, archive);
+}
+
+RtspPusher::RtspPusher(const std::vector<Output> &outputs, AudioGenerator &&generator, GstAudioFormat audio_format, int sample_rate, const std::optional<ArchiveOptions> &archive) : data_ptr(std::make_unique<GstreamerData>())
+{
+  data_ptr->sample_rate = sample_rate;
+  data_ptr->generator_slot = std::make_shared<GeneratorSlot>();
+  data_ptr->generator_slot->data = data_ptr.get();
+  data_ptr->generator_slot->generator = std::move(generator);
+  // The coroutine may yield on any thread, the chunk is pushed from the main loop.
+  // Weak, so the coroutine frame doesn't keep its own slot alive.
+  data_ptr->generator_slot->generator->set_on_suspend([weak_slot = std::weak_ptr<GeneratorSlot>(data_ptr->generator_slot)]()
+                                                      { return on_generator_suspend(weak_slot.lock()); });
+  build_pipeline(outputs, audio_format, archive);
+}
+
+void RtspPusher::build_pipeline(const std::vector<Output> &outputs, GstAudioFormat audio_format, const std::optional<ArchiveOptions> &archive)
+{
+  if (outputs.empty())
+  {
+    throw std::runtime_error("At least one output is required");
+  }
+
+  gst_init(nullptr, nullptr);
+
+  data_ptr->outputs = outputs;
   data_ptr->app_source = gst_element_factory_make("appsrc", "audio_source");
   data_ptr->tee = gst_element_factory_make("tee", "tee");
   data_ptr->audio_queue = gst_element_factory_make("queue", "audio_queue");
@@ -15,19 +46,16 @@ RtspPusher::RtspPusher(const std::string &rtsp_url, const std::function<int(uint
       gst_element_factory_make("audioconvert", "audio_convert1");
   data_ptr->audio_resample =
       gst_element_factory_make("audioresample", "audio_resample");
-  data_ptr->audio_encode = gst_element_factory_make("opusenc", "opus-encode"),
-  data_ptr->audio_parse = gst_element_factory_make("opusparse", "opus-parse"),
-  data_ptr->audio_sink = gst_element_factory_make("rtspclientsink", "rtsp-client"),
+  data_ptr->encode_tee = gst_element_factory_make("tee", "encode_tee");
 
   data_ptr->pipeline = gst_pipeline_new("main-pipeline");
 
-  if (!data_ptr->pipeline || !data_ptr->app_source || !data_ptr->tee || !data_ptr->audio_queue || !data_ptr->audio_convert1 || !data_ptr->audio_resample || !data_ptr->audio_encode || !data_ptr->audio_parse || !data_ptr->audio_sink)
+  if (!data_ptr->pipeline || !data_ptr->app_source || !data_ptr->tee || !data_ptr->audio_queue || !data_ptr->audio_convert1 || !data_ptr->audio_resample || !data_ptr->encode_tee)
   {
     g_printerr("Not all elements could be created.\n");
     throw std::runtime_error("Not all elements could be created");
   }
 
-  g_object_set(data_ptr->audio_sink, "location", data_ptr->rtsp_url.c_str(), nullptr);
   gst_audio_info_set_format(&(data_ptr->info), audio_format, data_ptr->sample_rate, 1, nullptr);
   data_ptr->audio_caps = gst_audio_info_to_caps(&(data_ptr->info));
   g_object_set(data_ptr->app_source, "caps", data_ptr->audio_caps, "format", GST_FORMAT_TIME,
@@ -44,9 +72,8 @@ RtspPusher::RtspPusher(const std::string &rtsp_url, const std::function<int(uint
 
   gst_bin_add_many(GST_BIN(data_ptr->pipeline), data_ptr->app_source, data_ptr->tee,
                    data_ptr->audio_queue, data_ptr->audio_convert1, data_ptr->audio_resample,
-                   data_ptr->audio_encode, data_ptr->audio_parse,
-                   data_ptr->audio_sink, nullptr);
-  if (gst_element_link_many(data_ptr->app_source, data_ptr->tee, nullptr) != true || gst_element_link_many(data_ptr->audio_queue, data_ptr->audio_convert1, data_ptr->audio_resample, data_ptr->audio_encode, data_ptr->audio_parse, nullptr) != true)
+                   data_ptr->encode_tee, nullptr);
+  if (gst_element_link_many(data_ptr->app_source, data_ptr->tee, nullptr) != true || gst_element_link_many(data_ptr->audio_queue, data_ptr->audio_convert1, data_ptr->audio_resample, data_ptr->encode_tee, nullptr) != true)
   {
     g_printerr("Elements could not be linked.\n");
     gst_object_unref(data_ptr->pipeline);
@@ -55,43 +82,200 @@ RtspPusher::RtspPusher(const std::string &rtsp_url, const std::function<int(uint
 
   data_ptr->tee_audio_pad = gst_element_request_pad_simple(data_ptr->tee, "src_%u");
   data_ptr->queue_audio_pad = gst_element_get_static_pad(data_ptr->audio_queue, "sink");
-  data_ptr->parse_src_pad = gst_element_get_static_pad(data_ptr->audio_parse, "src");
-  data_ptr->rtsp_sink_pad = gst_element_request_pad_simple(data_ptr->audio_sink, "sink_%u");
-  if (gst_pad_link(data_ptr->tee_audio_pad, data_ptr->queue_audio_pad) != GST_PAD_LINK_OK ||
-      gst_pad_link(data_ptr->parse_src_pad, data_ptr->rtsp_sink_pad) != GST_PAD_LINK_OK)
+  if (gst_pad_link(data_ptr->tee_audio_pad, data_ptr->queue_audio_pad) != GST_PAD_LINK_OK)
   {
     g_printerr("Tee could not be linked\n");
     gst_object_unref(data_ptr->pipeline);
     throw std::runtime_error("Tee could not be linked");
   }
   gst_object_unref(data_ptr->queue_audio_pad);
-  gst_object_unref(data_ptr->parse_src_pad);
+
+  if (archive.has_value())
+  {
+    create_archive_branch(archive.value());
+  }
+
+  // Every output gets its own encoder, the raw audio is converted and resampled only once.
+  for (size_t i = 0; i < data_ptr->outputs.size(); i++)
+  {
+    const auto &output = data_ptr->outputs[i];
+    const auto suffix = std::to_string(i);
+    EncoderBranch branch;
+    branch.queue = gst_element_factory_make("queue", ("encode_queue" + suffix).c_str());
+    branch.audio_encode = gst_element_factory_make("opusenc", ("opus-encode" + suffix).c_str());
+    branch.audio_parse = gst_element_factory_make("opusparse", ("opus-parse" + suffix).c_str());
+    branch.audio_sink = gst_element_factory_make("rtspclientsink", ("rtsp-client" + suffix).c_str());
+
+    if (!branch.queue || !branch.audio_encode || !branch.audio_parse || !branch.audio_sink)
+    {
+      g_printerr("Not all elements could be created.\n");
+      gst_object_unref(data_ptr->pipeline);
+      throw std::runtime_error("Not all elements could be created");
+    }
+
+    if (output.bitrate > 0)
+    {
+      g_object_set(branch.audio_encode, "bitrate", output.bitrate, nullptr);
+    }
+    g_object_set(branch.audio_sink, "location", output.rtsp_url.c_str(), nullptr);
+
+    gst_bin_add_many(GST_BIN(data_ptr->pipeline), branch.queue, branch.audio_encode,
+                     branch.audio_parse, branch.audio_sink, nullptr);
+    if (gst_element_link_many(branch.queue, branch.audio_encode, branch.audio_parse, nullptr) != true)
+    {
+      g_printerr("Elements could not be linked.\n");
+      gst_object_unref(data_ptr->pipeline);
+      throw std::runtime_error("Elements could not be linked");
+    }
+
+    branch.encode_tee_pad = gst_element_request_pad_simple(data_ptr->encode_tee, "src_%u");
+    branch.queue_pad = gst_element_get_static_pad(branch.queue, "sink");
+    branch.parse_src_pad = gst_element_get_static_pad(branch.audio_parse, "src");
+    branch.rtsp_sink_pad = gst_element_request_pad_simple(branch.audio_sink, "sink_%u");
+    // The archive tee goes between the parser and the sink of the first output
+    const bool is_archived = i == 0 && data_ptr->archive != nullptr;
+    if (gst_pad_link(branch.encode_tee_pad, branch.queue_pad) != GST_PAD_LINK_OK ||
+        (is_archived && (gst_pad_link(branch.parse_src_pad, data_ptr->archive->tee_sink_pad) != GST_PAD_LINK_OK ||
+                         gst_pad_link(data_ptr->archive->live_tee_pad, branch.rtsp_sink_pad) != GST_PAD_LINK_OK)) ||
+        (!is_archived && gst_pad_link(branch.parse_src_pad, branch.rtsp_sink_pad) != GST_PAD_LINK_OK))
+    {
+      g_printerr("Tee could not be linked\n");
+      gst_object_unref(data_ptr->pipeline);
+      throw std::runtime_error("Tee could not be linked");
+    }
+    gst_object_unref(branch.queue_pad);
+    gst_object_unref(branch.parse_src_pad);
+
+    data_ptr->encoder_branches.push_back(branch);
+  }
 
   data_ptr->bus = gst_element_get_bus(data_ptr->pipeline);
   gst_bus_add_signal_watch(data_ptr->bus);
   g_signal_connect(G_OBJECT(data_ptr->bus), "message::error", (GCallback)error_cb,
                    data_ptr.get());
+  g_signal_connect(G_OBJECT(data_ptr->bus), "message::element", (GCallback)element_message_cb,
+                   data_ptr.get());
+  g_signal_connect(G_OBJECT(data_ptr->bus), "message::eos", (GCallback)eos_cb,
+                   data_ptr.get());
   gst_object_unref(data_ptr->bus);
 
-  data_ptr->main_loop = g_main_loop_new(nullptr, false);
 }
 
-RtspPusher::RtspPusher(RtspPusher &&other) : data_ptr(std::move(other.data_ptr)), g_main_loop_future(std::move(other.g_main_loop_future))
+void RtspPusher::create_archive_branch(const ArchiveOptions &options)
+{
+  std::string extension;
+  std::string muxer_name;
+  if (options.container == "ogg")
+  {
+    extension = "ogg";
+    muxer_name = "oggmux";
+  }
+  else if (options.container == "mkv")
+  {
+    extension = "mkv";
+    muxer_name = "matroskamux";
+  }
+  else
+  {
+    gst_object_unref(data_ptr->pipeline);
+    throw std::runtime_error("Unsupported archive container: " + options.container);
+  }
+
+  // All the limits of the queue would be 0, which means unlimited
+  if (options.max_queued_buffers == 0)
+  {
+    gst_object_unref(data_ptr->pipeline);
+    throw std::runtime_error("max_queued_buffers of the archive must be at least 1");
+  }
+
+  try
+  {
+    std::filesystem::create_directories(options.directory);
+  }
+  catch (const std::exception &e)
+  {
+    gst_object_unref(data_ptr->pipeline);
+    throw std::runtime_error("Could not create the archive directory " + options.directory);
+  }
+
+  // Segments of every publishing get their own prefix, so they never overwrite older ones
+  static std::atomic<unsigned> publishing_counter = 0;
+  std::string prefix;
+  do
+  {
+    prefix = std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count()) +
+             '-' + std::to_string(publishing_counter++);
+  } while (std::filesystem::exists(std::filesystem::path(options.directory) / (prefix + ".idx")));
+  const auto location = (std::filesystem::path(options.directory) / (prefix + "-%05d." + extension)).string();
+
+  data_ptr->archive = std::make_unique<ArchiveBranch>();
+  auto &archive = *data_ptr->archive;
+  archive.index_path = (std::filesystem::path(options.directory) / (prefix + ".idx")).string();
+  archive.on_segment = options.on_segment;
+  // Reserve the prefix right away
+  std::ofstream(archive.index_path, std::ios::app);
+  archive.tee = gst_element_factory_make("tee", "archive_tee");
+  archive.queue = gst_element_factory_make("queue", "archive_queue");
+  archive.muxer = gst_element_factory_make(muxer_name.c_str(), "archive_muxer");
+  archive.sink = gst_element_factory_make("splitmuxsink", "archive_sink");
+
+  if (!archive.tee || !archive.queue || !archive.muxer || !archive.sink)
+  {
+    g_printerr("Not all elements could be created.\n");
+    gst_object_unref(data_ptr->pipeline);
+    throw std::runtime_error("Not all elements could be created");
+  }
+
+  // Leaky queue: when the disk is too slow the oldest buffers are dropped instead of blocking the tee
+  g_object_set(archive.queue, "leaky", 2, "max-size-buffers", options.max_queued_buffers,
+               "max-size-bytes", (guint)0, "max-size-time", (guint64)0, nullptr);
+  g_object_set(archive.sink, "muxer", archive.muxer, "location", location.c_str(),
+               "max-size-bytes", options.max_segment_bytes,
+               "max-size-time", options.max_segment_duration, nullptr);
+
+  gst_bin_add_many(GST_BIN(data_ptr->pipeline), archive.tee, archive.queue, archive.sink, nullptr);
+
+  archive.tee_sink_pad = gst_element_get_static_pad(archive.tee, "sink");
+  archive.live_tee_pad = gst_element_request_pad_simple(archive.tee, "src_%u");
+  archive.archive_tee_pad = gst_element_request_pad_simple(archive.tee, "src_%u");
+  archive.queue_pad = gst_element_get_static_pad(archive.queue, "sink");
+  archive.queue_src_pad = gst_element_get_static_pad(archive.queue, "src");
+  archive.sink_pad = gst_element_request_pad_simple(archive.sink, "audio_%u");
+  if (gst_pad_link(archive.archive_tee_pad, archive.queue_pad) != GST_PAD_LINK_OK ||
+      gst_pad_link(archive.queue_src_pad, archive.sink_pad) != GST_PAD_LINK_OK)
+  {
+    g_printerr("Tee could not be linked\n");
+    gst_object_unref(data_ptr->pipeline);
+    throw std::runtime_error("Tee could not be linked");
+  }
+  gst_object_unref(archive.queue_pad);
+  gst_object_unref(archive.queue_src_pad);
+}
+
+RtspPusher::RtspPusher(RtspPusher &&other) : data_ptr(std::move(other.data_ptr))
 {
 }
 
 RtspPusher &RtspPusher::operator=(RtspPusher &&other)
 {
   data_ptr = std::move(other.data_ptr);
-  g_main_loop_future = std::move(other.g_main_loop_future);
   return *this;
 }
 
 // TODO: fix resume
 void RtspPusher::start()
 {
-  g_main_loop_future = std::async(std::launch::async, [this]()
-                                  { g_main_loop_run(data_ptr->main_loop); });
+  if (data_ptr->archive != nullptr)
+  {
+    std::lock_guard<std::mutex> lock(data_ptr->archive->mutex);
+    data_ptr->archive->start_time = std::chrono::system_clock::now();
+    data_ptr->archive->finished = false;
+  }
+  if (!data_ptr->main_loop_acquired)
+  {
+    acquire_main_loop();
+    data_ptr->main_loop_acquired = true;
+  }
   GstStateChangeReturn st = gst_element_set_state(data_ptr->pipeline, GST_STATE_PLAYING);
   if (st == GST_STATE_CHANGE_FAILURE)
   {
@@ -103,6 +287,7 @@ void RtspPusher::start()
 
 void RtspPusher::stop()
 {
+  finish_archive();
   GstStateChangeReturn st = gst_element_set_state(data_ptr->pipeline, GST_STATE_READY);
   if (st == GST_STATE_CHANGE_FAILURE)
   {
@@ -112,10 +297,170 @@ void RtspPusher::stop()
   }
 }
 
+std::vector<RtspPusher::ArchiveSegment> RtspPusher::get_archive_segments() const
+{
+  if (data_ptr == nullptr || data_ptr->archive == nullptr)
+  {
+    return {};
+  }
+  std::lock_guard<std::mutex> lock(data_ptr->archive->mutex);
+  return data_ptr->archive->segments;
+}
+
+std::optional<RtspPusher::ArchiveSegment> RtspPusher::find_archive_segment(const std::vector<ArchiveSegment> &segments, std::chrono::system_clock::time_point time)
+{
+  // First segment starting after time, the one before it is the candidate
+  auto segment = std::upper_bound(segments.begin(), segments.end(), time, [](std::chrono::system_clock::time_point time, const ArchiveSegment &segment)
+                                  { return time < segment.start_time; });
+  if (segment == segments.begin())
+  {
+    return std::nullopt;
+  }
+  segment--;
+  if (time >= segment->end_time.value_or(std::chrono::system_clock::now()))
+  {
+    return std::nullopt;
+  }
+  return *segment;
+}
+
+std::vector<RtspPusher::ArchiveSegment> RtspPusher::load_archive_segments(const std::string &directory)
+{
+  std::vector<ArchiveSegment> segments;
+  if (!std::filesystem::is_directory(directory))
+  {
+    return segments;
+  }
+
+  for (const auto &entry : std::filesystem::directory_iterator(directory))
+  {
+    if (entry.path().extension() != ".idx")
+    {
+      continue;
+    }
+    // Lines: "open|close <tab> unix time in ns <tab> location"
+    std::ifstream index_file(entry.path());
+    std::string line;
+    while (std::getline(index_file, line))
+    {
+      const auto first_tab = line.find('\t');
+      const auto second_tab = line.find('\t', first_tab + 1);
+      if (first_tab == std::string::npos || second_tab == std::string::npos)
+      {
+        continue; // Torn line
+      }
+      const auto record = line.substr(0, first_tab);
+      const auto location = line.substr(second_tab + 1);
+      std::chrono::system_clock::time_point time;
+      try
+      {
+        time = std::chrono::system_clock::time_point(std::chrono::duration_cast<std::chrono::system_clock::duration>(
+            std::chrono::nanoseconds(std::stoll(line.substr(first_tab + 1, second_tab - first_tab - 1)))));
+      }
+      catch (const std::exception &e)
+      {
+        continue;
+      }
+
+      if (record == "open")
+      {
+        segments.push_back({location, time, std::nullopt});
+      }
+      else if (record == "close")
+      {
+        const auto segment = std::find_if(segments.rbegin(), segments.rend(), [&location](const ArchiveSegment &segment)
+                                          { return segment.location == location; });
+        if (segment != segments.rend())
+        {
+          segment->end_time = time;
+        }
+      }
+    }
+  }
+
+  std::sort(segments.begin(), segments.end(), [](const ArchiveSegment &a, const ArchiveSegment &b)
+            { return a.start_time < b.start_time; });
+  for (size_t i = 0; i + 1 < segments.size(); i++)
+  {
+    if (!segments[i].end_time.has_value())
+    {
+      segments[i].end_time = segments[i + 1].start_time;
+    }
+  }
+  return segments;
+}
+
+void RtspPusher::finish_archive()
+{
+  if (data_ptr->archive == nullptr)
+  {
+    return;
+  }
+  auto &archive = *data_ptr->archive;
+
+  GstState state = GST_STATE_NULL;
+  gst_element_get_state(data_ptr->pipeline, &state, nullptr, 0);
+  // The EOS message is dispatched by the main loop
+  if (state == GST_STATE_PLAYING && data_ptr->main_loop_acquired)
+  {
+    GstFlowReturn ret;
+    g_signal_emit_by_name(data_ptr->app_source, "end-of-stream", &ret);
+    std::unique_lock<std::mutex> lock(archive.mutex);
+    if (!archive.finished_cv.wait_for(lock, std::chrono::seconds(5), [&archive]()
+                                      { return archive.finished; }))
+    {
+      g_printerr("The last archive segment could not be finalized in time.\n");
+    }
+  }
+
+  std::vector<std::string> open_locations;
+  {
+    std::lock_guard<std::mutex> lock(archive.mutex);
+    for (const auto &segment : archive.segments)
+    {
+      if (!segment.end_time.has_value())
+      {
+        open_locations.push_back(segment.location);
+      }
+    }
+  }
+  for (const auto &location : open_locations)
+  {
+    add_archive_record(archive, false, location, std::chrono::system_clock::now());
+  }
+}
+
 RtspPusher::~RtspPusher()
 {
   if (data_ptr != nullptr)
   {
+    finish_archive();
+
+    if (data_ptr->generator_slot != nullptr)
+    {
+      const auto detach_generator = [slot = data_ptr->generator_slot]()
+      {
+        std::lock_guard<std::mutex> lock(slot->mutex);
+        slot->data = nullptr;
+        if (slot->running)
+        {
+          // It's in the middle of an await on some other thread, so it destroys itself when it suspends
+          // (see on_generator_suspend)
+          slot->generator->release();
+        }
+        slot->generator = std::nullopt;
+      };
+      // The generator is resumed only on the main loop, so it can't be reset while resume() is being called
+      if (data_ptr->main_loop_acquired)
+      {
+        run_on_main_loop(detach_generator);
+      }
+      else
+      {
+        detach_generator();
+      }
+    }
+
     GstStateChangeReturn st = gst_element_set_state(data_ptr->pipeline, GST_STATE_NULL);
     if (st == GST_STATE_CHANGE_FAILURE)
     {
@@ -123,13 +468,44 @@ RtspPusher::~RtspPusher()
       gst_object_unref(data_ptr->pipeline);
     }
     gst_element_release_request_pad(data_ptr->tee, data_ptr->tee_audio_pad);
-    gst_element_release_request_pad(data_ptr->audio_sink, data_ptr->rtsp_sink_pad);
     gst_object_unref(data_ptr->tee_audio_pad);
-    gst_object_unref(data_ptr->rtsp_sink_pad);
+    if (data_ptr->archive != nullptr)
+    {
+      auto &archive = *data_ptr->archive;
+      gst_element_release_request_pad(archive.tee, archive.live_tee_pad);
+      gst_element_release_request_pad(archive.tee, archive.archive_tee_pad);
+      gst_element_release_request_pad(archive.sink, archive.sink_pad);
+      gst_object_unref(archive.tee_sink_pad);
+      gst_object_unref(archive.live_tee_pad);
+      gst_object_unref(archive.archive_tee_pad);
+      gst_object_unref(archive.sink_pad);
+    }
+    for (auto &branch : data_ptr->encoder_branches)
+    {
+      gst_element_release_request_pad(data_ptr->encode_tee, branch.encode_tee_pad);
+      gst_element_release_request_pad(branch.audio_sink, branch.rtsp_sink_pad);
+      gst_object_unref(branch.encode_tee_pad);
+      gst_object_unref(branch.rtsp_sink_pad);
+    }
+
+    if (data_ptr->main_loop_acquired)
+    {
+      // No callback of this pusher may run after data_ptr is freed
+      auto *data = data_ptr.get();
+      run_on_main_loop([data]()
+                       {
+        if (data->sourceid != 0)
+        {
+          g_source_remove(data->sourceid);
+          data->sourceid = 0;
+        }
+        GstBus *bus = gst_element_get_bus(data->pipeline);
+        gst_bus_remove_signal_watch(bus);
+        gst_object_unref(bus); });
+      release_main_loop();
+    }
 
     gst_object_unref(data_ptr->pipeline);
-    g_main_loop_quit(data_ptr->main_loop);
-    g_main_loop_future.wait();
   }
 }
 
@@ -143,6 +519,18 @@ gboolean RtspPusher::push_data(GstreamerData *data)
   const auto num_samples = data->data_provider(map.data, data->chunk_size, data->sample_rate);
 
   gst_buffer_unmap(buffer, &map);
+
+  if (push_buffer(data, buffer, num_samples) != GST_FLOW_OK)
+  {
+    data->sourceid = 0; // The source is removed when it returns false
+    return false;
+  }
+
+  return true;
+}
+
+GstFlowReturn RtspPusher::push_buffer(GstreamerData *data, GstBuffer *buffer, int num_samples)
+{
   data->num_samples += num_samples;
 
   GST_BUFFER_TIMESTAMP(buffer) =
@@ -154,17 +542,159 @@ gboolean RtspPusher::push_data(GstreamerData *data)
   g_signal_emit_by_name(data->app_source, "push-buffer", buffer, &ret);
 
   gst_buffer_unref(buffer);
+  return ret;
+}
+
+gboolean RtspPusher::resume_generator(std::shared_ptr<GeneratorSlot> *slot_ptr)
+{
+  const auto slot = *slot_ptr;
+  delete slot_ptr;
 
-  if (ret != GST_FLOW_OK)
   {
-    return false;
+    std::lock_guard<std::mutex> lock(slot->mutex);
+    if (slot->data == nullptr || slot->running || slot->has_chunk || !slot->generator.has_value() || slot->generator->done() || !slot->data->feeding)
+    {
+      return false;
+    }
+    slot->running = true;
   }
+  // Not under the lock, the coroutine may suspend right away.
+  // The generator is reset only on the main loop (see ~RtspPusher), so it's still there.
+  slot->generator->resume();
+  return false;
+}
 
+bool RtspPusher::on_generator_suspend(const std::shared_ptr<GeneratorSlot> &slot)
+{
+  if (slot == nullptr)
+  {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(slot->mutex);
+  slot->running = false;
+  if (slot->data == nullptr)
+  {
+    // The pusher is gone and has released the coroutine
+    return false;
+  }
+  slot->has_chunk = true;
+  g_idle_add((GSourceFunc)generator_suspended, new std::shared_ptr<GeneratorSlot>(slot));
   return true;
 }
 
+gboolean RtspPusher::generator_suspended(std::shared_ptr<GeneratorSlot> *slot_ptr)
+{
+  const auto slot = *slot_ptr;
+  delete slot_ptr;
+
+  {
+    std::lock_guard<std::mutex> lock(slot->mutex);
+    slot->has_chunk = false;
+    if (slot->data == nullptr || !slot->generator.has_value())
+    {
+      return false;
+    }
+
+    auto *data = slot->data;
+    const auto chunk = slot->generator->take_chunk();
+    if (chunk.has_value())
+    {
+      GstBuffer *buffer = gst_buffer_new_and_alloc(chunk->data.size());
+      GstMapInfo map;
+      gst_buffer_map(buffer, &map, GST_MAP_WRITE);
+      std::copy(chunk->data.begin(), chunk->data.end(), map.data);
+      gst_buffer_unmap(buffer, &map);
+
+      if (push_buffer(data, buffer, chunk->num_samples) != GST_FLOW_OK)
+      {
+        return false;
+      }
+    }
+
+    if (slot->generator->done())
+    {
+      try
+      {
+        slot->generator->rethrow_if_failed();
+      }
+      catch (const std::exception &e)
+      {
+        g_printerr("Audio generator failed: %s\n", e.what());
+      }
+      GstFlowReturn ret;
+      g_signal_emit_by_name(data->app_source, "end-of-stream", &ret);
+      return false;
+    }
+
+    if (!data->feeding)
+    {
+      return false;
+    }
+    slot->running = true;
+  }
+  // See resume_generator
+  slot->generator->resume();
+  return false;
+}
+
+RtspPusher::SharedMainLoop &RtspPusher::shared_main_loop()
+{
+  static SharedMainLoop shared_main_loop;
+  return shared_main_loop;
+}
+
+void RtspPusher::acquire_main_loop()
+{
+  auto &shared = shared_main_loop();
+  std::lock_guard<std::mutex> lock(shared.mutex);
+  if (shared.users++ == 0)
+  {
+    // Default context, so that g_idle_add() and the bus watches are dispatched by it
+    shared.loop = g_main_loop_new(nullptr, false);
+    shared.thread = std::thread([loop = shared.loop]()
+                                { g_main_loop_run(loop); });
+  }
+}
+
+void RtspPusher::release_main_loop()
+{
+  auto &shared = shared_main_loop();
+  std::lock_guard<std::mutex> lock(shared.mutex);
+  if (--shared.users == 0)
+  {
+    // Quit from an idle callback, so the pending ones run first and it works even if the loop has not started yet
+    g_idle_add(+[](gpointer loop) -> gboolean
+               { g_main_loop_quit(static_cast<GMainLoop *>(loop));
+                 return false; },
+               shared.loop);
+    shared.thread.join();
+    g_main_loop_unref(shared.loop);
+    shared.loop = nullptr;
+  }
+}
+
+void RtspPusher::run_on_main_loop(const std::function<void()> &function)
+{
+  std::promise<void> done;
+  auto task = std::make_pair(&function, &done);
+  g_idle_add(+[](gpointer task_ptr) -> gboolean
+             {
+               auto *task = static_cast<std::pair<const std::function<void()> *, std::promise<void> *> *>(task_ptr);
+               (*task->first)();
+               task->second->set_value();
+               return false; },
+             &task);
+  done.get_future().wait();
+}
+
 void RtspPusher::start_feed(GstElement *source, guint size, GstreamerData *data)
 {
+  if (data->generator_slot != nullptr)
+  {
+    data->feeding = true;
+    g_idle_add((GSourceFunc)resume_generator, new std::shared_ptr<GeneratorSlot>(data->generator_slot));
+    return;
+  }
   if (data->sourceid == 0)
   {
     data->sourceid = g_idle_add((GSourceFunc)push_data, data);
@@ -173,6 +703,12 @@ void RtspPusher::start_feed(GstElement *source, guint size, GstreamerData *data)
 
 void RtspPusher::stop_feed(GstElement *source, GstreamerData *data)
 {
+  if (data->generator_slot != nullptr)
+  {
+    // The generator is not resumed again until need-data
+    data->feeding = false;
+    return;
+  }
   if (data->sourceid != 0)
   {
     g_source_remove(data->sourceid);
@@ -192,5 +728,78 @@ void RtspPusher::error_cb(GstBus *bus, GstMessage *msg, GstreamerData *data)
   g_clear_error(&err);
   g_free(debug_info);
 
-  g_main_loop_quit(data->main_loop);
-}
\ No newline at end of file
+  // The main loop is shared with other pushers, only this one stops feeding
+  stop_feed(data->app_source, data);
+
+  if (data->archive != nullptr)
+  {
+    std::lock_guard<std::mutex> lock(data->archive->mutex);
+    data->archive->finished = true;
+    data->archive->finished_cv.notify_all();
+  }
+}
+
+void RtspPusher::eos_cb(GstBus *bus, GstMessage *msg, GstreamerData *data)
+{
+  // splitmuxsink has closed its last segment by now, its message was posted before the EOS
+  if (data->archive != nullptr)
+  {
+    std::lock_guard<std::mutex> lock(data->archive->mutex);
+    data->archive->finished = true;
+    data->archive->finished_cv.notify_all();
+  }
+}
+
+void RtspPusher::element_message_cb(GstBus *bus, GstMessage *msg, GstreamerData *data)
+{
+  if (data->archive == nullptr)
+  {
+    return;
+  }
+
+  const GstStructure *structure = gst_message_get_structure(msg);
+  if (structure == nullptr)
+  {
+    return;
+  }
+  const bool opened = gst_structure_has_name(structure, "splitmuxsink-fragment-opened");
+  const bool closed = gst_structure_has_name(structure, "splitmuxsink-fragment-closed");
+  const gchar *location = gst_structure_get_string(structure, "location");
+  GstClockTime running_time = GST_CLOCK_TIME_NONE;
+  if ((!opened && !closed) || location == nullptr || !gst_structure_get_clock_time(structure, "running-time", &running_time))
+  {
+    return;
+  }
+
+  auto &archive = *data->archive;
+  add_archive_record(archive, opened, location, archive.start_time + std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::nanoseconds(running_time)));
+}
+
+void RtspPusher::add_archive_record(ArchiveBranch &archive, bool opened, const std::string &location, std::chrono::system_clock::time_point time)
+{
+  std::optional<ArchiveSegment> segment;
+  {
+    std::lock_guard<std::mutex> lock(archive.mutex);
+    std::ofstream index_file(archive.index_path, std::ios::app);
+    index_file << (opened ? "open" : "close") << '\t' << std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count() << '\t' << location << '\n';
+    if (opened)
+    {
+      segment = archive.segments.emplace_back(ArchiveSegment{location, time, std::nullopt});
+    }
+    else
+    {
+      const auto open_segment = std::find_if(archive.segments.rbegin(), archive.segments.rend(), [&location](const ArchiveSegment &segment)
+                                             { return segment.location == location; });
+      if (open_segment != archive.segments.rend())
+      {
+        open_segment->end_time = time;
+        segment = *open_segment;
+      }
+    }
+  }
+  // Not under the lock, so the callback may call get_archive_segments()
+  if (segment.has_value() && archive.on_segment)
+  {
+    archive.on_segment(segment.value());
+  }
+}